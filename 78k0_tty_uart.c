@@ -0,0 +1,380 @@
+/*
+ * Renesas μPD78F0730 through the Linux upd78f0730 tty driver
+ *
+ * Copyright (c) 2011-2012 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU LGPL version 2.1 or (at your option) any later version.
+ */
+#ifdef __linux__
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+/* termios2 for arbitrary rates such as 76800 and 153600 */
+#include <asm/termbits.h>
+#include <libusb-1.0/libusb.h>
+#include "78k0_tty_uart.h"
+#include "bswap.h"
+
+struct TTY78K0 {
+    int fd;
+    int epoll_fd;
+    /* Events epoll_fd currently waits for */
+    uint32_t events;
+    struct termios2 tio;
+};
+
+static int64_t tty_78k0_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* Wait until the tty is ready for events, returns a libusb error code */
+static int tty_78k0_wait(struct TTY78K0 *tty, uint32_t events, int64_t deadline)
+{
+    if (tty->events != events) {
+        struct epoll_event ev = { .events = events, .data.fd = tty->fd };
+        if (epoll_ctl(tty->epoll_fd, EPOLL_CTL_MOD, tty->fd, &ev) != 0) {
+            fprintf(stderr, "%s: epoll_ctl failed: %s\n", __func__, strerror(errno));
+            return LIBUSB_ERROR_IO;
+        }
+        tty->events = events;
+    }
+
+    struct epoll_event ev;
+    int n;
+    do {
+        int64_t timeout = deadline - tty_78k0_now_ms();
+        n = epoll_wait(tty->epoll_fd, &ev, 1, timeout > 0 ? timeout : 0);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        fprintf(stderr, "%s: epoll_wait failed: %s\n", __func__, strerror(errno));
+        return LIBUSB_ERROR_IO;
+    }
+    if (n == 0)
+        return LIBUSB_ERROR_TIMEOUT;
+    /* The driver hangs up when the bridge is unplugged */
+    if (ev.events & EPOLLHUP)
+        return LIBUSB_ERROR_NO_DEVICE;
+    if (!(ev.events & events))
+        return LIBUSB_ERROR_IO;
+    return LIBUSB_SUCCESS;
+}
+
+static int tty_78k0_apply(struct TTY78K0 *tty)
+{
+    if (ioctl(tty->fd, TCSETS2, &tty->tio) != 0) {
+        fprintf(stderr, "%s: TCSETS2 failed: %s\n", __func__, strerror(errno));
+        return LIBUSB_ERROR_IO;
+    }
+    return LIBUSB_SUCCESS;
+}
+
+static int tty_78k0_line_control(struct TTY78K0 *tty, uint32_t baud_rate, uint8_t params)
+{
+    struct termios2 *tio = &tty->tio;
+    tio->c_cflag &= ~(CBAUD | CSIZE | PARENB | PARODD | CSTOPB | CRTSCTS);
+    tio->c_cflag |= BOTHER;
+    tio->c_ispeed = tio->c_ospeed = baud_rate;
+
+    tio->c_cflag |= (params & USB_78K0_LINE_CONTROL_DATA_SIZE_8) ? CS8 : CS7;
+    if (params & USB_78K0_LINE_CONTROL_STOP_BITS_2)
+        tio->c_cflag |= CSTOPB;
+    switch (params & (3 << 2)) {
+    case USB_78K0_LINE_CONTROL_PARITY_EVEN:
+        tio->c_cflag |= PARENB;
+        break;
+    case USB_78K0_LINE_CONTROL_PARITY_ODD:
+        tio->c_cflag |= PARENB | PARODD;
+        break;
+    }
+    tio->c_iflag &= ~(IXON | IXOFF);
+    switch (params & (3 << 4)) {
+    case USB_78K0_LINE_CONTROL_FLOW_CONTROL_HARDWARE:
+        tio->c_cflag |= CRTSCTS;
+        break;
+    case USB_78K0_LINE_CONTROL_FLOW_CONTROL_SOFTWARE:
+        tio->c_iflag |= IXON | IXOFF;
+        break;
+    }
+    return tty_78k0_apply(tty);
+}
+
+static int tty_78k0_set_dtr_rts(struct TTY78K0 *tty, uint8_t bits)
+{
+    int lines;
+    if (ioctl(tty->fd, TIOCMGET, &lines) != 0) {
+        fprintf(stderr, "%s: TIOCMGET failed: %s\n", __func__, strerror(errno));
+        return LIBUSB_ERROR_IO;
+    }
+    lines &= ~(TIOCM_DTR | TIOCM_RTS);
+    if (bits & USB_78K0_SET_DTR_RTS_DTR_ON)
+        lines |= TIOCM_DTR;
+    if (bits & USB_78K0_SET_DTR_RTS_RTS_ON)
+        lines |= TIOCM_RTS;
+    if (ioctl(tty->fd, TIOCMSET, &lines) != 0) {
+        fprintf(stderr, "%s: TIOCMSET failed: %s\n", __func__, strerror(errno));
+        return LIBUSB_ERROR_IO;
+    }
+    return LIBUSB_SUCCESS;
+}
+
+/* Vendor requests map to termios and modem line ioctls */
+static int tty_78k0_control(struct UART78K0 *uart, const uint8_t *req, int length, int timeout)
+{
+    struct TTY78K0 *tty = uart->backend_opaque;
+    int ret;
+    switch (req[0]) {
+    case USB_78K0_REQUEST_LINE_CONTROL: {
+        const struct USB78K0RequestLineControl *lc = (const void *)req;
+        ret = tty_78k0_line_control(tty, le32_to_cpu(lc->bBaud), lc->bParams);
+        break;
+    }
+    case USB_78K0_REQUEST_SET_DTR_RTS:
+        ret = tty_78k0_set_dtr_rts(tty, req[1]);
+        break;
+    case USB_78K0_REQUEST_SET_XON_XOFF_CHR:
+        tty->tio.c_cc[VSTART] = req[1];
+        tty->tio.c_cc[VSTOP] = req[2];
+        ret = tty_78k0_apply(tty);
+        break;
+    case USB_78K0_REQUEST_OPEN_CLOSE:
+        /* The driver opens the port along with the node, just drop stale data */
+        ret = LIBUSB_SUCCESS;
+        if (ioctl(tty->fd, TCFLSH, TCIOFLUSH) != 0)
+            ret = LIBUSB_ERROR_IO;
+        break;
+    case USB_78K0_REQUEST_SET_ERR_CHR:
+        /* No termios equivalent, the driver leaves error substitution off */
+        ret = LIBUSB_SUCCESS;
+        break;
+    default:
+        fprintf(stderr, "%s: unsupported request %02" PRIX8 "\n", __func__, req[0]);
+        return LIBUSB_ERROR_NOT_SUPPORTED;
+    }
+    return (ret == LIBUSB_SUCCESS) ? length : ret;
+}
+
+static int tty_78k0_write(struct UART78K0 *uart, uint8_t *data, int length, int *transferred, int timeout)
+{
+    struct TTY78K0 *tty = uart->backend_opaque;
+    int64_t deadline = tty_78k0_now_ms() + timeout;
+    *transferred = 0;
+    while (*transferred < length) {
+        ssize_t n = write(tty->fd, data + *transferred, length - *transferred);
+        if (n > 0) {
+            *transferred += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno != EAGAIN) {
+            /* fprintf() may clobber errno, and EIO is how an unplug shows */
+            int err = errno;
+            fprintf(stderr, "%s: write failed: %s\n", __func__, strerror(err));
+            return (err == EIO) ? LIBUSB_ERROR_NO_DEVICE : LIBUSB_ERROR_IO;
+        }
+        int ret = tty_78k0_wait(tty, EPOLLOUT, deadline);
+        if (ret != LIBUSB_SUCCESS)
+            return ret;
+    }
+    return LIBUSB_SUCCESS;
+}
+
+static int tty_78k0_writev(struct UART78K0 *uart, const struct iovec *iov, int iovcnt, int *transferred,
+                           int timeout)
+{
+    struct TTY78K0 *tty = uart->backend_opaque;
+    int64_t deadline = tty_78k0_now_ms() + timeout;
+    *transferred = 0;
+    if (iovcnt <= 0)
+        return LIBUSB_SUCCESS;
+    /* Copy of the unsent tail; the kernel gathers straight from the callers' buffers */
+    struct iovec rest[iovcnt];
+    memcpy(rest, iov, iovcnt * sizeof(struct iovec));
+    struct iovec *cur = rest;
+    while (iovcnt > 0) {
+        if (cur->iov_len == 0) {
+            cur++;
+            iovcnt--;
+            continue;
+        }
+        ssize_t n = writev(tty->fd, cur, iovcnt);
+        if (n > 0) {
+            *transferred += n;
+            while (n > 0) {
+                size_t step = ((size_t)n < cur->iov_len) ? (size_t)n : cur->iov_len;
+                cur->iov_base = (uint8_t *)cur->iov_base + step;
+                cur->iov_len -= step;
+                n -= step;
+                if (cur->iov_len == 0) {
+                    cur++;
+                    iovcnt--;
+                }
+            }
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno != EAGAIN) {
+            /* fprintf() may clobber errno, and EIO is how an unplug shows */
+            int err = errno;
+            fprintf(stderr, "%s: write failed: %s\n", __func__, strerror(err));
+            return (err == EIO) ? LIBUSB_ERROR_NO_DEVICE : LIBUSB_ERROR_IO;
+        }
+        int ret = tty_78k0_wait(tty, EPOLLOUT, deadline);
+        if (ret != LIBUSB_SUCCESS)
+            return ret;
+    }
+    return LIBUSB_SUCCESS;
+}
+
+/* Like a bulk IN transfer, returns whatever has arrived once anything has */
+static int tty_78k0_read(struct UART78K0 *uart, uint8_t *data, int length, int *transferred, int timeout)
+{
+    struct TTY78K0 *tty = uart->backend_opaque;
+    int64_t deadline = tty_78k0_now_ms() + timeout;
+    *transferred = 0;
+    while (true) {
+        ssize_t n = read(tty->fd, data, length);
+        if (n > 0) {
+            *transferred = n;
+            return LIBUSB_SUCCESS;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno != EAGAIN) {
+            /* fprintf() may clobber errno, and EIO is how an unplug shows */
+            int err = errno;
+            fprintf(stderr, "%s: read failed: %s\n", __func__, strerror(err));
+            return (err == EIO) ? LIBUSB_ERROR_NO_DEVICE : LIBUSB_ERROR_IO;
+        }
+        int ret = tty_78k0_wait(tty, EPOLLIN, deadline);
+        if (ret != LIBUSB_SUCCESS)
+            return ret;
+    }
+}
+
+static int tty_78k0_fd(struct UART78K0 *uart)
+{
+    struct TTY78K0 *tty = uart->backend_opaque;
+    return tty->fd;
+}
+
+static const struct UART78K0Backend tty_backend = {
+    .control = tty_78k0_control,
+    .write = tty_78k0_write,
+    .read = tty_78k0_read,
+    .writev = tty_78k0_writev,
+    .fd = tty_78k0_fd,
+};
+
+int tty_78k0_open(struct UART78K0 *uart, const char *path)
+{
+    struct TTY78K0 *tty = calloc(1, sizeof(struct TTY78K0));
+    tty->epoll_fd = -1;
+    tty->fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (tty->fd < 0) {
+        fprintf(stderr, "%s: opening %s failed: %s\n", __func__, path, strerror(errno));
+        goto fail;
+    }
+    /* Keep other programs off the port, like claiming the interface */
+    if (ioctl(tty->fd, TIOCEXCL) != 0 || ioctl(tty->fd, TCGETS2, &tty->tio) != 0) {
+        fprintf(stderr, "%s: setting up %s failed: %s\n", __func__, path, strerror(errno));
+        goto fail;
+    }
+
+    /* Raw 8N1 at 9600 baud, reads never block inside the driver */
+    struct termios2 *tio = &tty->tio;
+    tio->c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL |
+                      IXON | IXOFF | IXANY | INPCK);
+    tio->c_oflag &= ~OPOST;
+    tio->c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    /* RTS drives the target's RESET line, closing must not drop it */
+    tio->c_cflag &= ~HUPCL;
+    tio->c_cflag |= CLOCAL | CREAD;
+    tio->c_cc[VMIN] = 0;
+    tio->c_cc[VTIME] = 0;
+    if (tty_78k0_line_control(tty, 9600, USB_78K0_LINE_CONTROL_DATA_SIZE_8) != LIBUSB_SUCCESS)
+        goto fail;
+
+    tty->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = tty->fd };
+    if (tty->epoll_fd < 0 || epoll_ctl(tty->epoll_fd, EPOLL_CTL_ADD, tty->fd, &ev) != 0) {
+        fprintf(stderr, "%s: epoll setup failed: %s\n", __func__, strerror(errno));
+        goto fail;
+    }
+    tty->events = EPOLLIN;
+
+    uart->context = NULL;
+    uart->handle = NULL;
+    uart->backend = &tty_backend;
+    uart->backend_opaque = tty;
+    return 0;
+
+fail:
+    if (tty->epoll_fd >= 0)
+        close(tty->epoll_fd);
+    if (tty->fd >= 0)
+        close(tty->fd);
+    free(tty);
+    return -1;
+}
+
+void tty_78k0_close(struct UART78K0 *uart)
+{
+    struct TTY78K0 *tty = uart->backend_opaque;
+    close(tty->epoll_fd);
+    close(tty->fd);
+    free(tty);
+    uart->backend = NULL;
+    uart->backend_opaque = NULL;
+}
+
+static int tty_78k0_read_attr(const char *dir, const char *name, char *buf, size_t size)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    char *line = fgets(buf, size, f);
+    fclose(f);
+    if (line == NULL)
+        return -1;
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+
+int tty_78k0_serial(const char *path, char *buf, size_t size)
+{
+    char link[PATH_MAX], usb_dir[PATH_MAX];
+    const char *name = strrchr(path, '/');
+    name = (name != NULL) ? name + 1 : path;
+    /* .../<usb device>/<interface>/ttyUSBn */
+    snprintf(link, sizeof(link), "/sys/class/tty/%s/device/../..", name);
+    if (realpath(link, usb_dir) == NULL)
+        return -1;
+    if (tty_78k0_read_attr(usb_dir, "serial", buf, size) == 0 && buf[0] != '\0')
+        return 0;
+    /* No serial number, fall back to the port as the libusb path does */
+    char bus[16], address[16];
+    if (tty_78k0_read_attr(usb_dir, "busnum", bus, sizeof(bus)) != 0 ||
+        tty_78k0_read_attr(usb_dir, "devnum", address, sizeof(address)) != 0)
+        return -1;
+    snprintf(buf, size, "%03d-%03d", atoi(bus), atoi(address));
+    return 0;
+}
+
+#endif
@@ -0,0 +1,26 @@
+/*
+ * Renesas μPD78F0730 through the Linux upd78f0730 tty driver
+ *
+ * Copyright (c) 2011-2012 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU LGPL version 2.1 or (at your option) any later version.
+ */
+#ifndef _78K0_TTY_UART_H
+#define _78K0_TTY_UART_H
+
+
+#include <stddef.h>
+
+#include "78k0_usb_uart.h"
+
+
+#ifdef __linux__
+/* Route requests and transfers of uart to a tty node such as /dev/ttyUSB0 */
+int tty_78k0_open(struct UART78K0 *uart, const char *path);
+void tty_78k0_close(struct UART78K0 *uart);
+/* USB serial number of the bridge behind the tty node, from sysfs */
+int tty_78k0_serial(const char *path, char *buf, size_t size);
+#endif
+
+
+#endif
@@ -10,68 +10,137 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <libusb-1.0/libusb.h>
 #include "v850j.h"
 //#define UART_ASYNC_READ
 #include "78k0_usb_uart.h"
 #include "bswap.h"
+#include "trace.h"
+#include "stats.h"
 
 #define TIMEOUT_MS 1000
 
 #define RETRY_MAX 5
 #define ENDPOINT_OUT 0x02
 #define ENDPOINT_IN  0x81
+/* Staging for gathered bulk OUT writes, in 64-byte max-size packets */
+#define USB_78K0_GATHER_SIZE (8 * 64)
 
 
-static void dump_request(uint8_t *req, int len)
+
+#ifdef UART_ASYNC_READ
+static size_t usb_78k0_read_available(struct UART78K0 *uart)
+{
+    return __atomic_load_n(&uart->read_head, __ATOMIC_SEQ_CST) -
+           __atomic_load_n(&uart->read_tail, __ATOMIC_ACQUIRE);
+}
+
+static bool usb_78k0_read_reserve(struct UART78K0 *uart)
 {
-    printf("78K0 request:");
-    for (int i = 0; i < len; i++) {
-        printf(" %02" PRIX8, req[i]);
+    size_t reserved = __atomic_load_n(&uart->read_reserved, __ATOMIC_ACQUIRE);
+    do {
+        if (usb_78k0_read_available(uart) + reserved + UART_ASYNC_READ_PACKET_SIZE >
+            UART_ASYNC_READ_BUFFER_SIZE) {
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(&uart->read_reserved, &reserved,
+                                          reserved + UART_ASYNC_READ_PACKET_SIZE, false,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    return true;
+}
+
+static void usb_78k0_read_unreserve(struct UART78K0 *uart)
+{
+    __atomic_fetch_sub(&uart->read_reserved, UART_ASYNC_READ_PACKET_SIZE, __ATOMIC_ACQ_REL);
+}
+
+static void usb_78k0_read_submit(struct UART78K0 *uart, int index)
+{
+    int ret = libusb_submit_transfer(uart->read_transfers[index]);
+    if (ret != LIBUSB_SUCCESS) {
+        fprintf(stderr, "Resubmitting transfer failed: %d\n", ret);
+        usb_78k0_read_unreserve(uart);
+    }
+}
+
+/*
+ * Resubmit transfers that were parked for lack of ring space. Called by
+ * both threads; whoever clears a parked bit owns that transfer.
+ */
+static void usb_78k0_read_unpark(struct UART78K0 *uart)
+{
+    uint32_t parked;
+    while ((parked = __atomic_load_n(&uart->read_parked, __ATOMIC_ACQUIRE)) != 0) {
+        if (!usb_78k0_read_reserve(uart))
+            return;
+        int index = __builtin_ctz(parked);
+        uint32_t bit = UINT32_C(1) << index;
+        if (__atomic_fetch_and(&uart->read_parked, ~bit, __ATOMIC_ACQ_REL) & bit) {
+            usb_78k0_read_submit(uart, index);
+        } else {
+            usb_78k0_read_unreserve(uart);
+        }
     }
-    printf("\n");
 }
 
-#ifdef UART_ASYNC_READ
 static void usb_78k0_read_callback(struct libusb_transfer *transfer)
 {
     struct UART78K0 *uart = transfer->user_data;
-    if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+    int index = transfer->buffer - uart->read_transfer_buffers[0];
+    index /= UART_ASYNC_READ_PACKET_SIZE;
+
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED &&
+        transfer->status != LIBUSB_TRANSFER_TIMED_OUT) {
+        fprintf(stderr, "Transfer failed: %d\n", transfer->status);
+        usb_78k0_read_unreserve(uart);
+        return;
+    }
+
+    /* Space for this packet was reserved on submission, so nothing is dropped */
+    size_t head = uart->read_head;
+    size_t offset = head & (UART_ASYNC_READ_BUFFER_SIZE - 1);
+    size_t first = UART_ASYNC_READ_BUFFER_SIZE - offset;
+    if (first > transfer->actual_length)
+        first = transfer->actual_length;
+    memcpy(uart->read_buffer + offset, transfer->buffer, first);
+    memcpy(uart->read_buffer, transfer->buffer + first, transfer->actual_length - first);
+    __atomic_store_n(&uart->read_head, head + transfer->actual_length, __ATOMIC_SEQ_CST);
+    usb_78k0_read_unreserve(uart);
+
+    size_t wanted = __atomic_load_n(&uart->read_wanted, __ATOMIC_SEQ_CST);
+    if (wanted != 0 && usb_78k0_read_available(uart) >= wanted) {
         pthread_mutex_lock(&uart->read_mutex);
-        if (uart->read_buffer_size < sizeof(uart->read_buffer)) {
-            int size = (sizeof(uart->read_buffer) - uart->read_buffer_size > transfer->actual_length)
-                       ? transfer->actual_length : (sizeof(uart->read_buffer) - uart->read_buffer_size);
-            memcpy(uart->read_buffer + uart->read_buffer_size, transfer->buffer, size);
-            uart->read_buffer_size += size;
-        }
         pthread_cond_signal(&uart->read_cond);
         pthread_mutex_unlock(&uart->read_mutex);
-        int ret = libusb_submit_transfer(transfer);
-        if (ret != LIBUSB_SUCCESS) {
-            fprintf(stderr, "Resubmitting transfer failed: %d\n", ret);
-        }
+    }
+
+    if (usb_78k0_read_reserve(uart)) {
+        usb_78k0_read_submit(uart, index);
     } else {
-        fprintf(stderr, "Transfer failed: %d\n", transfer->status);
+        __atomic_fetch_or(&uart->read_parked, UINT32_C(1) << index, __ATOMIC_ACQ_REL);
+        /* The reader may have made room meanwhile */
+        usb_78k0_read_unpark(uart);
     }
 }
 
 static void *usb_78k0_read_loop(void *opaque)
 {
     struct UART78K0 *uart = opaque;
-    struct libusb_transfer *transfers[2];
-    uint8_t buffers[2][64];
     int ret;
 
-    for (int i = 0; i < 2; i++) {
-        transfers[i] = libusb_alloc_transfer(0);
-        libusb_fill_bulk_transfer(transfers[i], uart->handle, ENDPOINT_IN,
-                                  buffers[i], 64, usb_78k0_read_callback,
-                                  uart, 0);
-        ret = libusb_submit_transfer(transfers[i]);
+    for (int i = 0; i < UART_ASYNC_READ_TRANSFERS; i++) {
+        uart->read_transfers[i] = libusb_alloc_transfer(0);
+        libusb_fill_bulk_transfer(uart->read_transfers[i], uart->handle, ENDPOINT_IN,
+                                  uart->read_transfer_buffers[i], UART_ASYNC_READ_PACKET_SIZE,
+                                  usb_78k0_read_callback, uart, 0);
+        if (usb_78k0_read_reserve(uart)) {
+            usb_78k0_read_submit(uart, i);
+        }
     }
 
     while (true) {
-        ret = libusb_handle_events(NULL);
+        ret = libusb_handle_events(uart->context);
         if (ret != LIBUSB_SUCCESS) {
             fprintf(stderr, "Handling events failed: %d\n", ret);
         }
@@ -82,10 +151,22 @@ static void *usb_78k0_read_loop(void *opaque)
 
 int usb_78k0_init(struct UART78K0 *uart)
 {
+    usb_78k0_invalidate(uart);
+    uart->batch = false;
+    uart->batch_pending = 0;
+    uart->batch_status = LIBUSB_SUCCESS;
+
 #ifdef UART_ASYNC_READ
+    if (uart->backend != NULL)
+        return 0;
+
     pthread_mutex_init(&uart->read_mutex, NULL);
     pthread_cond_init(&uart->read_cond, NULL);
-    uart->read_buffer_size = 0;
+    uart->read_head = 0;
+    uart->read_tail = 0;
+    uart->read_reserved = 0;
+    uart->read_parked = 0;
+    uart->read_wanted = 0;
 
     pthread_t thread;
     int ret = pthread_create(&thread, NULL, usb_78k0_read_loop, uart);
@@ -95,14 +176,129 @@ int usb_78k0_init(struct UART78K0 *uart)
 #endif
 }
 
+void usb_78k0_invalidate(struct UART78K0 *uart)
+{
+    __atomic_store_n(&uart->shadow_valid, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Runs on whichever thread handles libusb events, in gang mode possibly
+ * another board's, hence the atomic update of batch_shadow_valid.
+ */
+static void usb_78k0_control_callback(struct libusb_transfer *transfer)
+{
+    struct UART78K0 *uart = transfer->user_data;
+    uint8_t bit = 1 << transfer->buffer[LIBUSB_CONTROL_SETUP_SIZE];
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        fprintf(stderr, "Control transfer failed: %d\n", transfer->status);
+        __atomic_fetch_and(&uart->batch_shadow_valid, (uint8_t)~bit, __ATOMIC_ACQ_REL);
+        uart->batch_status = LIBUSB_ERROR_IO;
+    }
+    if (__atomic_sub_fetch(&uart->batch_pending, 1, __ATOMIC_ACQ_REL) == 0)
+        __atomic_store_n(&uart->batch_done, 1, __ATOMIC_RELEASE);
+}
+
+static int usb_78k0_control_submit(struct UART78K0 *uart, const uint8_t *req, int length)
+{
+    struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+    uint8_t *buf = malloc(LIBUSB_CONTROL_SETUP_SIZE + length);
+    libusb_fill_control_setup(buf, 0x40, 0x00, 0, 0, length);
+    memcpy(buf + LIBUSB_CONTROL_SETUP_SIZE, req, length);
+    libusb_fill_control_transfer(transfer, uart->handle, buf, usb_78k0_control_callback,
+                                 uart, TIMEOUT_MS);
+    transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER;
+    int ret = libusb_submit_transfer(transfer);
+    if (ret != LIBUSB_SUCCESS) {
+        libusb_free_transfer(transfer);
+        free(buf);
+        return ret;
+    }
+    __atomic_add_fetch(&uart->batch_pending, 1, __ATOMIC_ACQ_REL);
+    return length;
+}
+
+static int usb_78k0_control(struct UART78K0 *uart, void *req, int length)
+{
+    uint8_t request = *(uint8_t *)req;
+    uint8_t *shadow = uart->shadow[request];
+    uint8_t bit = 1 << request;
+    if (uart->batch && (__atomic_load_n(&uart->batch_shadow_valid, __ATOMIC_ACQUIRE) & bit)) {
+        /* Already submitted in this batch */
+        if (memcmp(uart->batch_shadow[request], req, length) == 0)
+            return length;
+    } else if ((__atomic_load_n(&uart->shadow_valid, __ATOMIC_ACQUIRE) & bit) &&
+               memcmp(shadow, req, length) == 0) {
+        return length;
+    }
+
+    TRACE(TRACE_CONTROL, req, length);
+    uint64_t start = STATS_START();
+    int ret;
+    if (uart->backend != NULL) {
+        ret = uart->backend->control(uart, req, length, TIMEOUT_MS);
+    } else if (uart->batch) {
+        /* Only applied once usb_78k0_batch_end() has seen it complete */
+        __atomic_fetch_and(&uart->shadow_valid, (uint8_t)~bit, __ATOMIC_ACQ_REL);
+        memcpy(uart->batch_shadow[request], req, length);
+        __atomic_fetch_or(&uart->batch_shadow_valid, bit, __ATOMIC_ACQ_REL);
+        ret = usb_78k0_control_submit(uart, req, length);
+        if (ret != length)
+            __atomic_fetch_and(&uart->batch_shadow_valid, (uint8_t)~bit, __ATOMIC_ACQ_REL);
+        STATS_TIME(STATS_CONTROL, start);
+        return ret;
+    } else {
+        ret = libusb_control_transfer(uart->handle, 0x40, 0x00, 0, 0, req, length, TIMEOUT_MS);
+    }
+    STATS_TIME(STATS_CONTROL, start);
+    if (ret == length) {
+        uart->last_transfer = stats_now();
+        memcpy(shadow, req, length);
+        __atomic_fetch_or(&uart->shadow_valid, bit, __ATOMIC_ACQ_REL);
+    } else {
+        __atomic_fetch_and(&uart->shadow_valid, (uint8_t)~bit, __ATOMIC_ACQ_REL);
+    }
+    return ret;
+}
+
+void usb_78k0_batch_begin(struct UART78K0 *uart)
+{
+    uart->batch = true;
+    uart->batch_status = LIBUSB_SUCCESS;
+    uart->batch_done = 0;
+    __atomic_store_n(&uart->batch_shadow_valid, 0, __ATOMIC_RELEASE);
+}
+
+int usb_78k0_batch_end(struct UART78K0 *uart)
+{
+    uart->batch = false;
+    /* Control transfers complete in submission order */
+    while (__atomic_load_n(&uart->batch_pending, __ATOMIC_ACQUIRE) != 0 &&
+           !__atomic_load_n(&uart->batch_done, __ATOMIC_ACQUIRE)) {
+        int ret = libusb_handle_events_completed(uart->context, &uart->batch_done);
+        if (ret != LIBUSB_SUCCESS) {
+            fprintf(stderr, "Handling events failed: %d\n", ret);
+            return ret;
+        }
+    }
+    /* The last request submitted per bRequest is now applied */
+    uint8_t valid = __atomic_load_n(&uart->batch_shadow_valid, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < USB_78K0_SHADOW_REQUESTS; i++) {
+        if (valid & (1 << i))
+            memcpy(uart->shadow[i], uart->batch_shadow[i], USB_78K0_SHADOW_SIZE);
+    }
+    __atomic_fetch_or(&uart->shadow_valid, valid, __ATOMIC_ACQ_REL);
+    if (valid != 0)
+        uart->last_transfer = stats_now();
+    return uart->batch_status;
+}
+
 int v850j_78k0_line_control(struct UART78K0 *uart, uint32_t baud_rate, uint8_t params)
 {
     struct USB78K0RequestLineControl req;
     req.bRequest = USB_78K0_REQUEST_LINE_CONTROL;
     req.bBaud = cpu_to_le32(baud_rate);
     req.bParams = params;
-    dump_request((uint8_t *)&req, sizeof(req));
-    return libusb_control_transfer(uart->handle, 0x40, 0x00, 0, 0, (unsigned char *)&req, sizeof(req), TIMEOUT_MS);
+    return usb_78k0_control(uart, &req, sizeof(req));
 }
 
 int v850j_78k0_set_dtr_rts_bits(struct UART78K0 *uart, uint8_t bits)
@@ -110,8 +306,7 @@ int v850j_78k0_set_dtr_rts_bits(struct UART78K0 *uart, uint8_t bits)
     struct USB78K0RequestSetDTRRTS req;
     req.bRequest = USB_78K0_REQUEST_SET_DTR_RTS;
     req.bParams = bits;
-    dump_request((uint8_t *)&req, sizeof(req));
-    return libusb_control_transfer(uart->handle, 0x40, 0x00, 0, 0, (unsigned char *)&req, sizeof(req), TIMEOUT_MS);
+    return usb_78k0_control(uart, &req, sizeof(req));
 }
 
 int v850j_78k0_set_dtr_rts(struct UART78K0 *uart, bool dtr, bool rts)
@@ -127,8 +322,7 @@ int v850j_78k0_set_xon_xoff_chr(struct UART78K0 *uart, char xon, char xoff)
     req.bRequest = USB_78K0_REQUEST_SET_XON_XOFF_CHR;
     req.XonChr = xon;
     req.XoffChr = xoff;
-    dump_request((uint8_t *)&req, sizeof(req));
-    return libusb_control_transfer(uart->handle, 0x40, 0x00, 0, 0, (unsigned char *)&req, sizeof(req), TIMEOUT_MS);
+    return usb_78k0_control(uart, &req, sizeof(req));
 }
 
 int v850j_78k0_open_close(struct UART78K0 *uart, bool open)
@@ -136,8 +330,7 @@ int v850j_78k0_open_close(struct UART78K0 *uart, bool open)
     struct USB78K0RequestOpenClose req;
     req.bRequest = USB_78K0_REQUEST_OPEN_CLOSE;
     req.bOpen = open ? USB_78K0_OPEN_CLOSE_OPENED : USB_78K0_OPEN_CLOSE_CLOSED;
-    dump_request((uint8_t *)&req, sizeof(req));
-    return libusb_control_transfer(uart->handle, 0x40, 0x00, 0, 0, (unsigned char *)&req, sizeof(req), TIMEOUT_MS);
+    return usb_78k0_control(uart, &req, sizeof(req));
 }
 
 int v850j_78k0_set_err_chr(struct UART78K0 *uart, bool open, char err)
@@ -146,12 +339,11 @@ int v850j_78k0_set_err_chr(struct UART78K0 *uart, bool open, char err)
     req.bRequest = USB_78K0_REQUEST_SET_ERR_CHR;
     req.bOpen = open ? USB_78K0_SET_ERR_CHR_ENABLED : USB_78K0_SET_ERR_CHR_DISABLED;
     req.ErrChr = err;
-    dump_request((uint8_t *)&req, sizeof(req));
-    return libusb_control_transfer(uart->handle, 0x40, 0x00, 0, 0, (unsigned char *)&req, sizeof(req), TIMEOUT_MS);
+    return usb_78k0_control(uart, &req, sizeof(req));
 }
 
 
-int usb_78k0_write(struct UART78K0 *uart, uint8_t *data, int length, int *transferred, int timeout)
+static int usb_78k0_bulk_write(struct UART78K0 *uart, uint8_t *data, int length, int *transferred, int timeout)
 {
     uint8_t endpoint = ENDPOINT_OUT;
     int ret;
@@ -161,13 +353,14 @@ int usb_78k0_write(struct UART78K0 *uart, uint8_t *data, int length, int *transf
                                    transferred, timeout);
         if (ret == LIBUSB_ERROR_PIPE) {
             libusb_clear_halt(uart->handle, endpoint);
+            STATS_COUNT(STATS_PIPE_RETRIES, 1);
         }
         try++;
     } while ((ret == LIBUSB_ERROR_PIPE) && (try < RETRY_MAX));
     return ret;
 }
 
-int usb_78k0_read(struct UART78K0 *uart, uint8_t *buf, int length, int *transferred, int timeout_ms)
+static int usb_78k0_bulk_read(struct UART78K0 *uart, uint8_t *buf, int length, int *transferred, int timeout_ms)
 {
 #ifndef UART_ASYNC_READ
     uint8_t endpoint = ENDPOINT_IN;
@@ -178,36 +371,178 @@ int usb_78k0_read(struct UART78K0 *uart, uint8_t *buf, int length, int *transfer
                                    transferred, timeout_ms);
         if (ret == LIBUSB_ERROR_PIPE) {
             libusb_clear_halt(uart->handle, endpoint);
+            STATS_COUNT(STATS_PIPE_RETRIES, 1);
         }
         try++;
     } while ((ret == LIBUSB_ERROR_PIPE) && (try < RETRY_MAX));
     return ret;
 #else
-    struct timeval start;
-    gettimeofday(&start, NULL);
     struct timespec timeout;
-    timeout.tv_sec = start.tv_sec + timeout_ms / 1000;
-    timeout.tv_nsec = start.tv_usec * 1000 + (timeout_ms % 1000) * 1000000;
+    clock_gettime(CLOCK_REALTIME, &timeout);
+    timeout.tv_sec += timeout_ms / 1000;
+    timeout.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (timeout.tv_nsec >= 1000000000) {
+        timeout.tv_sec++;
+        timeout.tv_nsec -= 1000000000;
+    }
 
     int ret = 0;
     *transferred = 0;
     while (*transferred < length && ret == 0) {
-        pthread_mutex_lock(&uart->read_mutex);
-        while (uart->read_buffer_size == 0) {
-            ret = pthread_cond_timedwait(&uart->read_cond, &uart->read_mutex, &timeout);
-            if (ret == ETIMEDOUT) {
-                break;
+        size_t available = usb_78k0_read_available(uart);
+        if (available < length - *transferred) {
+            /* Only get woken up once the whole remainder is there */
+            pthread_mutex_lock(&uart->read_mutex);
+            __atomic_store_n(&uart->read_wanted, length - *transferred, __ATOMIC_SEQ_CST);
+            while (usb_78k0_read_available(uart) < length - *transferred) {
+                ret = pthread_cond_timedwait(&uart->read_cond, &uart->read_mutex, &timeout);
+                if (ret == ETIMEDOUT) {
+                    break;
+                }
             }
+            __atomic_store_n(&uart->read_wanted, 0, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&uart->read_mutex);
+            available = usb_78k0_read_available(uart);
         }
-        int size = (uart->read_buffer_size > length - *transferred) ? (length - *transferred) : uart->read_buffer_size;
-        memcpy(buf + *transferred, uart->read_buffer, size);
+        size_t size = (available > length - *transferred) ? (length - *transferred) : available;
+        size_t tail = uart->read_tail;
+        size_t offset = tail & (UART_ASYNC_READ_BUFFER_SIZE - 1);
+        size_t first = UART_ASYNC_READ_BUFFER_SIZE - offset;
+        if (first > size)
+            first = size;
+        memcpy(buf + *transferred, uart->read_buffer + offset, first);
+        memcpy(buf + *transferred + first, uart->read_buffer, size - first);
+        __atomic_store_n(&uart->read_tail, tail + size, __ATOMIC_RELEASE);
         *transferred += size;
-        uart->read_buffer_size -= size;
-        if (uart->read_buffer_size > 0) {
-            memmove(uart->read_buffer, uart->read_buffer + size, uart->read_buffer_size);
-        }
-        pthread_mutex_unlock(&uart->read_mutex);
+        usb_78k0_read_unpark(uart);
+    }
+    if (ret == ETIMEDOUT) {
+        ret = (*transferred > 0) ? LIBUSB_SUCCESS : LIBUSB_ERROR_TIMEOUT;
     }
     return ret;
 #endif
 }
+
+void usb_78k0_fill_bulk_transfer(struct UART78K0 *uart, struct libusb_transfer *transfer, bool in,
+                                 uint8_t *data, int length, libusb_transfer_cb_fn callback,
+                                 void *user_data, unsigned int timeout)
+{
+    libusb_fill_bulk_transfer(transfer, uart->handle, in ? ENDPOINT_IN : ENDPOINT_OUT,
+                              data, length, callback, user_data, timeout);
+}
+
+int usb_78k0_write(struct UART78K0 *uart, uint8_t *data, int length, int *transferred, int timeout)
+{
+    uint64_t start = STATS_START();
+    int ret;
+    /* Not set by libusb if the transfer could not be submitted */
+    *transferred = 0;
+    if (uart->backend != NULL) {
+        ret = uart->backend->write(uart, data, length, transferred, timeout);
+    } else {
+        ret = usb_78k0_bulk_write(uart, data, length, transferred, timeout);
+    }
+    STATS_TIME(STATS_BULK_WRITE, start);
+    STATS_COUNT(STATS_BYTES_WRITTEN, *transferred);
+    if (*transferred > 0)
+        uart->last_transfer = stats_now();
+    if (ret == LIBUSB_ERROR_TIMEOUT)
+        STATS_COUNT(STATS_TIMEOUTS, 1);
+    TRACE(TRACE_TX, data, *transferred);
+    return ret;
+}
+
+int usb_78k0_writev(struct UART78K0 *uart, const struct iovec *iov, int iovcnt, int *transferred,
+                    int timeout)
+{
+    uint64_t start = STATS_START();
+    int ret = LIBUSB_SUCCESS;
+    *transferred = 0;
+    /* A single non-empty piece, e.g. a pre-encoded frame, goes out in place */
+    int pieces = 0;
+    const struct iovec *piece = NULL;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > 0) {
+            pieces++;
+            piece = &iov[i];
+        }
+    }
+    if (uart->backend != NULL && uart->backend->writev != NULL) {
+        ret = uart->backend->writev(uart, iov, iovcnt, transferred, timeout);
+    } else if (pieces == 1) {
+        if (uart->backend != NULL)
+            ret = uart->backend->write(uart, piece->iov_base, piece->iov_len, transferred, timeout);
+        else
+            ret = usb_78k0_bulk_write(uart, piece->iov_base, piece->iov_len, transferred, timeout);
+    } else {
+        /*
+         * A bulk transfer needs one buffer, so gather into whole max-size
+         * packets; a frame or several fit a single transfer.
+         */
+        uint8_t staging[USB_78K0_GATHER_SIZE];
+        int i = 0;
+        size_t offset = 0;
+        while (ret == LIBUSB_SUCCESS && i < iovcnt) {
+            int fill = 0;
+            while (i < iovcnt && fill < sizeof(staging)) {
+                size_t n = iov[i].iov_len - offset;
+                if (n > sizeof(staging) - fill)
+                    n = sizeof(staging) - fill;
+                memcpy(staging + fill, (const uint8_t *)iov[i].iov_base + offset, n);
+                fill += n;
+                offset += n;
+                if (offset == iov[i].iov_len) {
+                    i++;
+                    offset = 0;
+                }
+            }
+            if (fill == 0)
+                break;
+            int n = 0;
+            if (uart->backend != NULL)
+                ret = uart->backend->write(uart, staging, fill, &n, timeout);
+            else
+                ret = usb_78k0_bulk_write(uart, staging, fill, &n, timeout);
+            *transferred += n;
+            if (n != fill)
+                break;
+        }
+    }
+    STATS_TIME(STATS_BULK_WRITE, start);
+    STATS_COUNT(STATS_BYTES_WRITTEN, *transferred);
+    if (*transferred > 0)
+        uart->last_transfer = stats_now();
+    if (ret == LIBUSB_ERROR_TIMEOUT)
+        STATS_COUNT(STATS_TIMEOUTS, 1);
+    if (trace_enabled) {
+        size_t left = *transferred;
+        for (int i = 0; i < iovcnt && left > 0; i++) {
+            size_t n = (iov[i].iov_len < left) ? iov[i].iov_len : left;
+            TRACE(TRACE_TX, iov[i].iov_base, n);
+            left -= n;
+        }
+    }
+    return ret;
+}
+
+int usb_78k0_read(struct UART78K0 *uart, uint8_t *buf, int length, int *transferred, int timeout)
+{
+    uint64_t start = STATS_START();
+    int ret;
+    /* Not set by libusb if the transfer could not be submitted */
+    *transferred = 0;
+    if (uart->backend != NULL) {
+        ret = uart->backend->read(uart, buf, length, transferred, timeout);
+    } else {
+        ret = usb_78k0_bulk_read(uart, buf, length, transferred, timeout);
+    }
+    STATS_TIME(STATS_BULK_READ, start);
+    STATS_COUNT(STATS_BYTES_READ, *transferred);
+    if (ret == LIBUSB_ERROR_TIMEOUT)
+        STATS_COUNT(STATS_TIMEOUTS, 1);
+    if (*transferred > 0) {
+        uart->last_transfer = stats_now();
+        TRACE(TRACE_RX, buf, *transferred);
+    }
+    return ret;
+}
@@ -27,17 +27,81 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 #ifdef UART_ASYNC_READ
 #include <pthread.h>
+
+/* Number of 64-byte bulk IN transfers kept in flight (at most 32) */
+#ifndef UART_ASYNC_READ_TRANSFERS
+#define UART_ASYNC_READ_TRANSFERS 8
+#endif
+#define UART_ASYNC_READ_PACKET_SIZE 64
+/* Must be a power of two */
+#define UART_ASYNC_READ_BUFFER_SIZE (UART_ASYNC_READ_TRANSFERS * UART_ASYNC_READ_PACKET_SIZE * 8)
+
+/* The ring is indexed by masking, read_parked has one bit per transfer */
+_Static_assert(UART_ASYNC_READ_TRANSFERS > 0 &&
+               (UART_ASYNC_READ_TRANSFERS & (UART_ASYNC_READ_TRANSFERS - 1)) == 0,
+               "UART_ASYNC_READ_TRANSFERS must be a power of two");
+_Static_assert(UART_ASYNC_READ_TRANSFERS <= 32, "UART_ASYNC_READ_TRANSFERS must be at most 32");
 #endif
 
 
+struct UART78K0;
+
+/* Transport replacing libusb, e.g. a simulated target */
+struct UART78K0Backend {
+    int (*control)(struct UART78K0 *uart, const uint8_t *req, int length, int timeout);
+    int (*write)(struct UART78K0 *uart, uint8_t *data, int length, int *transferred, int timeout);
+    int (*read)(struct UART78K0 *uart, uint8_t *data, int length, int *transferred, int timeout);
+    /* Optional, else usb_78k0_writev() gathers into write() calls */
+    int (*writev)(struct UART78K0 *uart, const struct iovec *iov, int iovcnt, int *transferred,
+                  int timeout);
+    /* Optional, polls readable once read() has data, for event loops */
+    int (*fd)(struct UART78K0 *uart);
+};
+
+#define USB_78K0_SHADOW_REQUESTS 5
+#define USB_78K0_SHADOW_SIZE 8
+
 struct UART78K0 {
+    libusb_context *context;
     libusb_device_handle *handle;
+    const struct UART78K0Backend *backend;
+    void *backend_opaque;
+    /* CLOCK_MONOTONIC time in ns the last transfer moved data or changed the line */
+    uint64_t last_transfer;
+    /* Last request applied per bRequest, to skip no-op control transfers */
+    uint8_t shadow[USB_78K0_SHADOW_REQUESTS][USB_78K0_SHADOW_SIZE];
+    uint8_t shadow_valid;
+    /* Control transfers submitted asynchronously until usb_78k0_batch_end() */
+    bool batch;
+    /*
+     * Last request submitted per bRequest in the current batch, folded into
+     * shadow once all of them completed; a failed completion clears its bit.
+     */
+    uint8_t batch_shadow[USB_78K0_SHADOW_REQUESTS][USB_78K0_SHADOW_SIZE];
+    uint8_t batch_shadow_valid;
+    int batch_pending;
+    int batch_done;
+    int batch_status;
 #ifdef UART_ASYNC_READ
-    uint8_t read_buffer[4096];
-    size_t read_buffer_size;
+    /*
+     * Single-producer/single-consumer ring: read_head is only advanced
+     * by the event thread, read_tail only by the reader.
+     */
+    uint8_t read_buffer[UART_ASYNC_READ_BUFFER_SIZE];
+    size_t read_head;
+    size_t read_tail;
+    /* Ring space claimed by transfers in flight */
+    size_t read_reserved;
+    /* Bitmask of transfers waiting for ring space */
+    uint32_t read_parked;
+    /* Bytes the reader is waiting for, 0 if none */
+    size_t read_wanted;
+    struct libusb_transfer *read_transfers[UART_ASYNC_READ_TRANSFERS];
+    uint8_t read_transfer_buffers[UART_ASYNC_READ_TRANSFERS][UART_ASYNC_READ_PACKET_SIZE];
     pthread_mutex_t read_mutex;
     pthread_cond_t read_cond;
 #endif
@@ -115,6 +179,9 @@ enum USB78K0SetErrChrParams {
 
 
 int usb_78k0_init(struct UART78K0 *uart);
+void usb_78k0_invalidate(struct UART78K0 *uart);
+void usb_78k0_batch_begin(struct UART78K0 *uart);
+int usb_78k0_batch_end(struct UART78K0 *uart);
 
 int v850j_78k0_line_control(struct UART78K0 *uart, uint32_t baud_rate, uint8_t params);
 int v850j_78k0_set_dtr_rts_bits(struct UART78K0 *uart, uint8_t bits);
@@ -125,6 +192,13 @@ int v850j_78k0_set_err_chr(struct UART78K0 *uart, bool open, char err);
 
 int usb_78k0_write(struct UART78K0 *uart, uint8_t *data, int length, int *transferred, int timeout);
 int usb_78k0_read(struct UART78K0 *uart, uint8_t *data, int length, int *transferred, int timeout);
+/* Write the concatenation of iov, e.g. header, payload in place and trailer of frames */
+int usb_78k0_writev(struct UART78K0 *uart, const struct iovec *iov, int iovcnt, int *transferred,
+                    int timeout);
+/* Bulk transfer on the data endpoints, for callers running their own event loop */
+void usb_78k0_fill_bulk_transfer(struct UART78K0 *uart, struct libusb_transfer *transfer, bool in,
+                                 uint8_t *data, int length, libusb_transfer_cb_fn callback,
+                                 void *user_data, unsigned int timeout);
 
 
 #endif
@@ -0,0 +1,102 @@
+/*
+ * Byte sum kernels for frame and block checksums
+ *
+ * Copyright (c) 2011-2012 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU LGPL version 2.1 or (at your option) any later version.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include "checksum.h"
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define CHECKSUM_X86
+#include <immintrin.h>
+#endif
+
+static uint32_t checksum_sum_scalar(const uint8_t *data, size_t length)
+{
+    uint32_t sum = 0;
+    for (size_t i = 0; i < length; i++) {
+        sum += data[i];
+    }
+    return sum;
+}
+
+#ifdef CHECKSUM_X86
+/* PSADBW against zero adds up eight bytes into each 64-bit lane */
+static uint32_t checksum_sum_sse2(const uint8_t *data, size_t length)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+    }
+    acc = _mm_add_epi64(acc, _mm_unpackhi_epi64(acc, acc));
+    return (uint32_t)_mm_cvtsi128_si32(acc) + checksum_sum_scalar(data + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static uint32_t checksum_sum_avx2(const uint8_t *data, size_t length)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = zero, acc1 = zero;
+    size_t i = 0;
+    for (; i + 64 <= length; i += 64) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(data + i + 32));
+        acc0 = _mm256_add_epi64(acc0, _mm256_sad_epu8(v0, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_sad_epu8(v1, zero));
+    }
+    acc0 = _mm256_add_epi64(acc0, acc1);
+    __m128i acc = _mm_add_epi64(_mm256_castsi256_si128(acc0), _mm256_extracti128_si256(acc0, 1));
+    acc = _mm_add_epi64(acc, _mm_unpackhi_epi64(acc, acc));
+    return (uint32_t)_mm_cvtsi128_si32(acc) + checksum_sum_sse2(data + i, length - i);
+}
+#endif
+
+uint32_t checksum_sum(const uint8_t *data, size_t length)
+{
+#ifdef CHECKSUM_X86
+    /* Frame checksums cover at most a few hundred bytes */
+    if (length < 64)
+        return checksum_sum_scalar(data, length);
+    if (__builtin_cpu_supports("avx2"))
+        return checksum_sum_avx2(data, length);
+    return checksum_sum_sse2(data, length);
+#else
+    return checksum_sum_scalar(data, length);
+#endif
+}
+
+int checksum_self_test(void)
+{
+#ifdef CHECKSUM_X86
+    /* Lengths around each kernel's stride, at every offset within a vector */
+    uint8_t buf[64 + 1024];
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        buf[i] = (uint8_t)(i * 167 + 13);
+    }
+    buf[100] = 0xff;
+    buf[101] = 0xff;
+    bool have_avx2 = __builtin_cpu_supports("avx2");
+    for (size_t offset = 0; offset < 64; offset++) {
+        for (size_t length = 0; length <= 1024; length++) {
+            const uint8_t *data = buf + offset;
+            uint32_t expected = checksum_sum_scalar(data, length);
+            uint32_t sse2 = checksum_sum_sse2(data, length);
+            uint32_t avx2 = have_avx2 ? checksum_sum_avx2(data, length) : expected;
+            if (sse2 != expected || avx2 != expected) {
+                fprintf(stderr, "%s: sum of %zu bytes at +%zu: %08" PRIX32 " SSE2 %08" PRIX32
+                        " AVX2 %08" PRIX32 "\n", __func__, length, offset, expected, sse2, avx2);
+                return -1;
+            }
+        }
+    }
+#endif
+    return 0;
+}
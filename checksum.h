@@ -0,0 +1,22 @@
+/*
+ * Byte sum kernels for frame and block checksums
+ *
+ * Copyright (c) 2011-2012 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU LGPL version 2.1 or (at your option) any later version.
+ */
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* Sum of all bytes, modulo 2^32 */
+uint32_t checksum_sum(const uint8_t *data, size_t length);
+/* Compare the vector kernels against the scalar one, 0 if all agree */
+int checksum_self_test(void);
+
+
+#endif
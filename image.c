@@ -0,0 +1,511 @@
+/*
+ * Firmware image loading
+ *
+ * Copyright (c) 2011-2012 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU LGPL version 2.1 or (at your option) any later version.
+ */
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "image.h"
+
+#define ELF_PT_LOAD     1
+#define ELF_SHT_NOBITS  8
+#define ELF_SHF_ALLOC   0x2
+
+/* Contents at one address range, pointing into the file or decode buffer */
+struct Segment {
+    uint32_t address;
+    size_t length;
+    const uint8_t *data;
+};
+
+struct SegmentMap {
+    struct Segment *segments;
+    size_t count;
+    size_t capacity;
+};
+
+static int segment_add(struct SegmentMap *map, uint64_t address, const uint8_t *data, size_t length)
+{
+    if (length == 0)
+        return 0;
+    if (address + length > UINT64_C(0x100000000)) {
+        fprintf(stderr, "%s: data at 0x%" PRIX64 " exceeds 32-bit address space\n", __func__, address);
+        return -1;
+    }
+    /* Consecutive records usually continue the previous segment */
+    if (map->count > 0) {
+        struct Segment *last = &map->segments[map->count - 1];
+        if (last->address + last->length == address && last->data + last->length == data) {
+            last->length += length;
+            return 0;
+        }
+    }
+    if (map->count == map->capacity) {
+        size_t capacity = (map->capacity == 0) ? 16 : map->capacity * 2;
+        struct Segment *segments = realloc(map->segments, capacity * sizeof(struct Segment));
+        if (segments == NULL)
+            return -1;
+        map->segments = segments;
+        map->capacity = capacity;
+    }
+    map->segments[map->count].address = address;
+    map->segments[map->count].length = length;
+    map->segments[map->count].data = data;
+    map->count++;
+    return 0;
+}
+
+static int hex_digit(uint8_t c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+/* Decode count hex byte pairs, returning -1 on a bad digit */
+static int hex_decode(const uint8_t *text, uint8_t *out, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        int hi = hex_digit(text[2 * i]);
+        int lo = hex_digit(text[2 * i + 1]);
+        if (hi < 0 || lo < 0)
+            return -1;
+        out[i] = (hi << 4) | lo;
+    }
+    return 0;
+}
+
+static size_t skip_space(const uint8_t *text, size_t size, size_t pos, size_t *line)
+{
+    while (pos < size && (text[pos] == '\n' || text[pos] == '\r' ||
+                          text[pos] == ' ' || text[pos] == '\t')) {
+        if (text[pos] == '\n')
+            (*line)++;
+        pos++;
+    }
+    return pos;
+}
+
+static int parse_ihex(struct SegmentMap *map, const char *filename,
+                      const uint8_t *text, size_t size, uint8_t *out)
+{
+    uint32_t base = 0;
+    size_t line = 1;
+    size_t pos = 0;
+    while ((pos = skip_space(text, size, pos, &line)) < size) {
+        uint8_t rec[5 + 255];
+        if (text[pos] != ':' || pos + 1 + 2 > size ||
+            hex_decode(text + pos + 1, rec, 1) != 0) {
+            fprintf(stderr, "%s:%zu: invalid record\n", filename, line);
+            return -1;
+        }
+        size_t count = 5 + rec[0];
+        if (pos + 1 + 2 * count > size || hex_decode(text + pos + 1, rec, count) != 0) {
+            fprintf(stderr, "%s:%zu: truncated record\n", filename, line);
+            return -1;
+        }
+        pos += 1 + 2 * count;
+
+        uint8_t sum = 0;
+        for (size_t i = 0; i < count; i++)
+            sum += rec[i];
+        if (sum != 0) {
+            fprintf(stderr, "%s:%zu: checksum mismatch\n", filename, line);
+            return -1;
+        }
+
+        uint8_t length = rec[0];
+        uint16_t offset = (rec[1] << 8) | rec[2];
+        switch (rec[3]) {
+        case 0x00:
+            memcpy(out, rec + 4, length);
+            if (segment_add(map, (uint64_t)base + offset, out, length) != 0)
+                return -1;
+            out += length;
+            break;
+        case 0x01:
+            return 0;
+        case 0x02:
+            base = ((rec[4] << 8) | rec[5]) << 4;
+            break;
+        case 0x04:
+            base = (uint32_t)((rec[4] << 8) | rec[5]) << 16;
+            break;
+        case 0x03:
+        case 0x05:
+            /* Start address, irrelevant for flashing */
+            break;
+        default:
+            fprintf(stderr, "%s:%zu: unknown record type %02" PRIX8 "\n", filename, line, rec[3]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int parse_srec(struct SegmentMap *map, const char *filename,
+                      const uint8_t *text, size_t size, uint8_t *out)
+{
+    size_t line = 1;
+    size_t pos = 0;
+    while ((pos = skip_space(text, size, pos, &line)) < size) {
+        uint8_t rec[1 + 255];
+        if (text[pos] != 'S' || pos + 4 > size || text[pos + 1] < '0' || text[pos + 1] > '9' ||
+            hex_decode(text + pos + 2, rec, 1) != 0) {
+            fprintf(stderr, "%s:%zu: invalid record\n", filename, line);
+            return -1;
+        }
+        int type = text[pos + 1] - '0';
+        size_t count = 1 + rec[0];
+        if (pos + 2 + 2 * count > size || hex_decode(text + pos + 2, rec, count) != 0) {
+            fprintf(stderr, "%s:%zu: truncated record\n", filename, line);
+            return -1;
+        }
+        pos += 2 + 2 * count;
+
+        uint8_t sum = 0;
+        for (size_t i = 0; i < count; i++)
+            sum += rec[i];
+        if (sum != 0xff) {
+            fprintf(stderr, "%s:%zu: checksum mismatch\n", filename, line);
+            return -1;
+        }
+
+        size_t address_size;
+        switch (type) {
+        case 1:
+        case 2:
+        case 3:
+            address_size = type + 1;
+            break;
+        case 7:
+        case 8:
+        case 9:
+            return 0;
+        default:
+            /* Header and record counts */
+            continue;
+        }
+        if (rec[0] < address_size + 1) {
+            fprintf(stderr, "%s:%zu: record too short\n", filename, line);
+            return -1;
+        }
+        uint32_t address = 0;
+        for (size_t i = 0; i < address_size; i++)
+            address = (address << 8) | rec[1 + i];
+        size_t length = rec[0] - address_size - 1;
+        memcpy(out, rec + 1 + address_size, length);
+        if (segment_add(map, address, out, length) != 0)
+            return -1;
+        out += length;
+    }
+    return 0;
+}
+
+static uint64_t elf_read(const uint8_t *p, size_t size, bool big_endian)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; i++)
+        value |= (uint64_t)p[big_endian ? (size - 1 - i) : i] << (8 * i);
+    return value;
+}
+
+static int parse_elf(struct SegmentMap *map, const char *filename,
+                     const uint8_t *file, size_t size, uint64_t limit)
+{
+    if (size < 52 || (file[4] != 1 && file[4] != 2) || (file[5] != 1 && file[5] != 2)) {
+        fprintf(stderr, "%s: unsupported ELF file\n", filename);
+        return -1;
+    }
+    bool is64 = file[4] == 2;
+    bool be = file[5] == 2;
+    size_t word = is64 ? 8 : 4;
+    if (is64 && size < 64) {
+        fprintf(stderr, "%s: truncated ELF header\n", filename);
+        return -1;
+    }
+
+    uint64_t phoff = elf_read(file + (is64 ? 32 : 28), word, be);
+    uint64_t shoff = elf_read(file + (is64 ? 40 : 32), word, be);
+    uint64_t phentsize = elf_read(file + (is64 ? 54 : 42), 2, be);
+    uint64_t phnum = elf_read(file + (is64 ? 56 : 44), 2, be);
+    uint64_t shentsize = elf_read(file + (is64 ? 58 : 46), 2, be);
+    uint64_t shnum = elf_read(file + (is64 ? 60 : 48), 2, be);
+
+    /* Program headers give load addresses; debug sections are never touched */
+    if (phnum > 0) {
+        if (phoff + phnum * phentsize > size || phentsize < (is64 ? 56 : 32)) {
+            fprintf(stderr, "%s: truncated program headers\n", filename);
+            return -1;
+        }
+        for (uint64_t i = 0; i < phnum; i++) {
+            const uint8_t *ph = file + phoff + i * phentsize;
+            if (elf_read(ph, 4, be) != ELF_PT_LOAD)
+                continue;
+            uint64_t offset = elf_read(ph + (is64 ? 8 : 4), word, be);
+            uint64_t paddr = elf_read(ph + (is64 ? 24 : 12), word, be);
+            uint64_t filesz = elf_read(ph + (is64 ? 32 : 16), word, be);
+            if (offset + filesz > size) {
+                fprintf(stderr, "%s: segment %" PRIu64 " exceeds file\n", filename, i);
+                return -1;
+            }
+            /* E.g. initialized RAM whose load address was not put in flash */
+            if (filesz > 0 && paddr + filesz > limit) {
+                fprintf(stderr, "%s: skipping segment %" PRIu64 " at 0x%08" PRIX64
+                                " (%" PRIu64 " bytes) outside flash\n", filename, i, paddr, filesz);
+                continue;
+            }
+            if (segment_add(map, paddr, file + offset, filesz) != 0)
+                return -1;
+        }
+        return 0;
+    }
+
+    /* Relocatable objects only have sections */
+    if (shoff + shnum * shentsize > size || shentsize < (is64 ? 64 : 40)) {
+        fprintf(stderr, "%s: truncated section headers\n", filename);
+        return -1;
+    }
+    for (uint64_t i = 0; i < shnum; i++) {
+        const uint8_t *sh = file + shoff + i * shentsize;
+        uint64_t type = elf_read(sh + 4, 4, be);
+        uint64_t flags = elf_read(sh + 8, word, be);
+        if (type == ELF_SHT_NOBITS || !(flags & ELF_SHF_ALLOC))
+            continue;
+        uint64_t addr = elf_read(sh + (is64 ? 16 : 12), word, be);
+        uint64_t offset = elf_read(sh + (is64 ? 24 : 16), word, be);
+        uint64_t sh_size = elf_read(sh + (is64 ? 32 : 20), word, be);
+        if (offset + sh_size > size) {
+            fprintf(stderr, "%s: section %" PRIu64 " exceeds file\n", filename, i);
+            return -1;
+        }
+        if (sh_size > 0 && addr + sh_size > limit) {
+            fprintf(stderr, "%s: skipping section %" PRIu64 " at 0x%08" PRIX64
+                            " (%" PRIu64 " bytes) outside flash\n", filename, i, addr, sh_size);
+            continue;
+        }
+        if (segment_add(map, addr, file + offset, sh_size) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int segment_compare(const void *a, const void *b)
+{
+    const struct Segment *sa = a, *sb = b;
+    return (sa->address > sb->address) - (sa->address < sb->address);
+}
+
+/*
+ * Merge segments into block-aligned chunks and copy them over in file
+ * order, so later records win where segments overlap.
+ */
+static int coalesce(struct Image *image, const struct SegmentMap *map, size_t block_size)
+{
+    struct Segment *sorted = malloc(map->count * sizeof(struct Segment));
+    struct ImageChunk *chunks = malloc(map->count * sizeof(struct ImageChunk));
+    if (sorted == NULL || chunks == NULL) {
+        free(sorted);
+        free(chunks);
+        return -1;
+    }
+    memcpy(sorted, map->segments, map->count * sizeof(struct Segment));
+    qsort(sorted, map->count, sizeof(struct Segment), segment_compare);
+
+    size_t num_chunks = 0;
+    uint64_t chunk_end = 0;
+    size_t total = 0;
+    for (size_t i = 0; i < map->count; i++) {
+        uint64_t start = sorted[i].address - sorted[i].address % block_size;
+        uint64_t end = (uint64_t)sorted[i].address + sorted[i].length;
+        end = (end + block_size - 1) / block_size * block_size;
+        if (num_chunks > 0 && start <= chunk_end) {
+            if (end > chunk_end) {
+                total += end - chunk_end;
+                chunk_end = end;
+                chunks[num_chunks - 1].length = chunk_end - chunks[num_chunks - 1].address;
+            }
+            continue;
+        }
+        chunks[num_chunks].address = start;
+        chunks[num_chunks].length = end - start;
+        num_chunks++;
+        total += end - start;
+        chunk_end = end;
+    }
+    free(sorted);
+
+    uint8_t *buffer = malloc(total);
+    if (buffer == NULL) {
+        free(chunks);
+        return -1;
+    }
+    memset(buffer, 0xff, total);
+    size_t offset = 0;
+    for (size_t i = 0; i < num_chunks; i++) {
+        chunks[i].data = buffer + offset;
+        offset += chunks[i].length;
+    }
+
+    for (size_t i = 0; i < map->count; i++) {
+        const struct Segment *seg = &map->segments[i];
+        size_t lo = 0, hi = num_chunks;
+        while (hi - lo > 1) {
+            size_t mid = (lo + hi) / 2;
+            if (chunks[mid].address <= seg->address)
+                lo = mid;
+            else
+                hi = mid;
+        }
+        memcpy(chunks[lo].data + (seg->address - chunks[lo].address), seg->data, seg->length);
+    }
+
+    image->chunks = chunks;
+    image->num_chunks = num_chunks;
+    image->buffer = buffer;
+    image->length = total;
+    return 0;
+}
+
+static bool has_extension(const char *filename, const char *extension)
+{
+    const char *dot = strrchr(filename, '.');
+    return dot != NULL && strcasecmp(dot + 1, extension) == 0;
+}
+
+/*
+ * Whether a well-formed Intel HEX or S-record record with a matching
+ * checksum starts at pos. A binary image may well begin with ':' or 'S'.
+ */
+static bool record_valid(const uint8_t *text, size_t size, size_t pos)
+{
+    uint8_t rec[5 + 255];
+    size_t digits, header;
+    uint8_t expected;
+    if (text[pos] == ':') {
+        digits = pos + 1;
+        header = 5;
+        expected = 0;
+    } else if (text[pos] == 'S' && pos + 1 < size && text[pos + 1] >= '0' && text[pos + 1] <= '9') {
+        digits = pos + 2;
+        header = 1;
+        expected = 0xff;
+    } else {
+        return false;
+    }
+    if (digits + 2 > size || hex_decode(text + digits, rec, 1) != 0)
+        return false;
+    size_t count = header + rec[0];
+    if (digits + 2 * count > size || hex_decode(text + digits, rec, count) != 0)
+        return false;
+    uint8_t sum = 0;
+    for (size_t i = 0; i < count; i++)
+        sum += rec[i];
+    return sum == expected;
+}
+
+int image_load(struct Image *image, const char *filename, size_t block_size, uint64_t limit)
+{
+    memset(image, 0, sizeof(*image));
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror(filename);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        fprintf(stderr, "%s: empty image\n", filename);
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size;
+    const uint8_t *file = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) {
+        perror(filename);
+        return -1;
+    }
+
+    struct SegmentMap map = { NULL, 0, 0 };
+    uint8_t *decoded = NULL;
+    size_t pos = 0, line = 1;
+    pos = skip_space(file, size, pos, &line);
+    /* Known extensions get the parser's errors instead of a raw fallback */
+    bool text = pos < size && !has_extension(filename, "bin") &&
+                (has_extension(filename, "hex") || has_extension(filename, "ihx") ||
+                 has_extension(filename, "srec") || has_extension(filename, "mot") ||
+                 has_extension(filename, "s19") || has_extension(filename, "s28") ||
+                 has_extension(filename, "s37") || record_valid(file, size, pos));
+    int ret;
+    if (size >= 4 && memcmp(file, "\x7f" "ELF", 4) == 0) {
+        ret = parse_elf(&map, filename, file, size, limit);
+    } else if (text) {
+        /* Decoded data is at most half the size of its hex text */
+        madvise((void *)file, size, MADV_SEQUENTIAL);
+        decoded = malloc(size / 2 + 1);
+        if (decoded == NULL) {
+            fprintf(stderr, "%s: out of memory\n", filename);
+            ret = -1;
+        } else if (file[pos] == 'S') {
+            ret = parse_srec(&map, filename, file, size, decoded);
+        } else {
+            ret = parse_ihex(&map, filename, file, size, decoded);
+        }
+    } else {
+        ret = segment_add(&map, 0, file, size);
+    }
+
+    if (ret == 0 && map.count == 0) {
+        fprintf(stderr, "%s: no loadable data\n", filename);
+        ret = -1;
+    }
+    if (ret == 0)
+        ret = coalesce(image, &map, block_size);
+
+    free(map.segments);
+    free(decoded);
+    munmap((void *)file, size);
+    return ret;
+}
+
+void image_free(struct Image *image)
+{
+    free(image->chunks);
+    free(image->buffer);
+    memset(image, 0, sizeof(*image));
+}
+
+uint64_t image_hash(const struct Image *image)
+{
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+    for (size_t i = 0; i < image->num_chunks; i++) {
+        const struct ImageChunk *chunk = &image->chunks[i];
+        uint8_t header[8];
+        for (int j = 0; j < 4; j++) {
+            header[j] = chunk->address >> (8 * j);
+            header[4 + j] = chunk->length >> (8 * j);
+        }
+        for (size_t j = 0; j < sizeof(header); j++) {
+            hash = (hash ^ header[j]) * UINT64_C(0x100000001b3);
+        }
+        for (size_t j = 0; j < chunk->length; j++) {
+            hash = (hash ^ chunk->data[j]) * UINT64_C(0x100000001b3);
+        }
+    }
+    return hash;
+}
@@ -0,0 +1,43 @@
+/*
+ * Firmware image loading
+ *
+ * Copyright (c) 2011-2012 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU LGPL version 2.1 or (at your option) any later version.
+ */
+#ifndef IMAGE_H
+#define IMAGE_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* A block-aligned run of flash contents, padded with 0xFF */
+struct ImageChunk {
+    uint32_t address;
+    size_t length;
+    uint8_t *data;
+};
+
+struct Image {
+    struct ImageChunk *chunks;
+    size_t num_chunks;
+    /* Backing store of all chunks */
+    uint8_t *buffer;
+    size_t length;
+};
+
+/*
+ * Load an Intel HEX, Motorola S-record, ELF or raw binary file (the latter
+ * placed at address 0) and coalesce its contents into chunks aligned to
+ * block_size. ELF segments reaching beyond limit, such as RAM, are skipped
+ * with a warning.
+ */
+int image_load(struct Image *image, const char *filename, size_t block_size, uint64_t limit);
+void image_free(struct Image *image);
+/* FNV-1a over chunk addresses and contents, identifies an image */
+uint64_t image_hash(const struct Image *image);
+
+
+#endif
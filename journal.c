@@ -0,0 +1,86 @@
+/*
+ * Progress journal for resumable flash sessions
+ *
+ * Copyright (c) 2011-2012 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU LGPL version 2.1 or (at your option) any later version.
+ */
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "journal.h"
+
+int journal_open(struct Journal *journal, const char *filename, uint64_t image_hash,
+                 size_t block_size, size_t flash_size)
+{
+    memset(journal, 0, sizeof(*journal));
+    journal->block_size = block_size;
+    journal->blocks = flash_size / block_size;
+    journal->done = calloc(journal->blocks, sizeof(bool));
+
+    /* Entries only count for the image they were written for */
+    bool same_image = false;
+    FILE *f = fopen(filename, "r");
+    if (f != NULL) {
+        char line[64];
+        uint64_t hash;
+        uint32_t address;
+        if (fgets(line, sizeof(line), f) != NULL &&
+            sscanf(line, "image=%" SCNx64, &hash) == 1 && hash == image_hash) {
+            same_image = true;
+            while (fgets(line, sizeof(line), f) != NULL) {
+                if (sscanf(line, "block=%" SCNx32, &address) == 1 &&
+                    address / block_size < journal->blocks) {
+                    journal->done[address / block_size] = true;
+                }
+            }
+        }
+        fclose(f);
+    }
+
+    journal->file = fopen(filename, same_image ? "a" : "w");
+    if (journal->file == NULL) {
+        perror(filename);
+        free(journal->done);
+        journal->done = NULL;
+        return -1;
+    }
+    if (!same_image) {
+        fprintf(journal->file, "image=%016" PRIx64 "\n", image_hash);
+        fflush(journal->file);
+    }
+    journal->filename = strdup(filename);
+    return 0;
+}
+
+bool journal_done(const struct Journal *journal, uint32_t address)
+{
+    return journal->done[address / journal->block_size];
+}
+
+void journal_forget(struct Journal *journal, uint32_t address)
+{
+    journal->done[address / journal->block_size] = false;
+}
+
+int journal_mark(struct Journal *journal, uint32_t address)
+{
+    journal->done[address / journal->block_size] = true;
+    fprintf(journal->file, "block=%06" PRIX32 "\n", address);
+    /* Survive the process going down with the USB link */
+    return fflush(journal->file);
+}
+
+void journal_close(struct Journal *journal, bool complete)
+{
+    if (journal->file != NULL) {
+        fclose(journal->file);
+        if (complete)
+            unlink(journal->filename);
+    }
+    free(journal->filename);
+    free(journal->done);
+    memset(journal, 0, sizeof(*journal));
+}
@@ -0,0 +1,40 @@
+/*
+ * Progress journal for resumable flash sessions
+ *
+ * Copyright (c) 2011-2012 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU LGPL version 2.1 or (at your option) any later version.
+ */
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+
+struct Journal {
+    FILE *file;
+    char *filename;
+    size_t block_size;
+    size_t blocks;
+    /* Blocks recorded as programmed */
+    bool *done;
+};
+
+/*
+ * Open the journal of an image, keeping the blocks recorded for the same
+ * image hash and starting afresh otherwise.
+ */
+int journal_open(struct Journal *journal, const char *filename, uint64_t image_hash,
+                 size_t block_size, size_t flash_size);
+bool journal_done(const struct Journal *journal, uint32_t address);
+void journal_forget(struct Journal *journal, uint32_t address);
+int journal_mark(struct Journal *journal, uint32_t address);
+/* Close the journal, deleting it once the whole image is programmed */
+void journal_close(struct Journal *journal, bool complete);
+
+
+#endif
@@ -6,17 +6,48 @@
  * Licensed under the GNU GPL version 2 or (at your option) any later version.
  */
 
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <libusb-1.0/libusb.h>
 #include "v850j.h"
+#include "78k0_tty_uart.h"
+#include "checksum.h"
+#include "image.h"
+#include "prepare.h"
+#include "journal.h"
+#include "trace.h"
+#include "stats.h"
 
-static struct V850Device *v850j_open(libusb_context *usb_context)
+static void usb_serial(libusb_device_handle *handle, char *buf, size_t size)
 {
-    struct V850Device *dev = malloc(sizeof(struct V850Device));
-    dev->uart.handle = libusb_open_device_with_vid_pid(usb_context, USB_VID_NEC, USB_PID_NEC_UART);
-    if (dev->uart.handle == NULL)
-        return NULL;
+    libusb_device *usb_dev = libusb_get_device(handle);
+    struct libusb_device_descriptor desc;
+    if (libusb_get_device_descriptor(usb_dev, &desc) == LIBUSB_SUCCESS &&
+        desc.iSerialNumber != 0 &&
+        libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber,
+                                           (unsigned char *)buf, size) > 0) {
+        return;
+    }
+    /* No serial number, fall back to the port */
+    snprintf(buf, size, "%03d-%03d",
+             libusb_get_bus_number(usb_dev), libusb_get_device_address(usb_dev));
+}
+
+static struct V850Device *v850j_claim(libusb_context *usb_context, libusb_device_handle *handle)
+{
+    struct V850Device *dev = calloc(1, sizeof(struct V850Device));
+    dev->uart.context = usb_context;
+    dev->uart.handle = handle;
+    usb_serial(handle, dev->serial, sizeof(dev->serial));
 
     int ret;
 
@@ -32,26 +63,120 @@ static struct V850Device *v850j_open(libusb_context *usb_context)
     if (ret != LIBUSB_SUCCESS) {
         fprintf(stderr, "claiming interface failed: %d\n", ret);
         libusb_close(dev->uart.handle);
+        free(dev);
         return NULL;
     }
 
     return dev;
 }
 
+static struct V850Device *v850j_open(libusb_context *usb_context)
+{
+    libusb_device_handle *handle;
+    handle = libusb_open_device_with_vid_pid(usb_context, USB_VID_NEC, USB_PID_NEC_UART);
+    if (handle == NULL)
+        return NULL;
+    return v850j_claim(usb_context, handle);
+}
+
+static struct V850Device *v850j_open_device(libusb_context *usb_context, libusb_device *usb_dev)
+{
+    libusb_device_handle *handle;
+    int ret = libusb_open(usb_dev, &handle);
+    if (ret != LIBUSB_SUCCESS) {
+        fprintf(stderr, "opening device failed: %d\n", ret);
+        return NULL;
+    }
+    return v850j_claim(usb_context, handle);
+}
+
 static void v850j_close(struct V850Device *dev)
 {
     libusb_release_interface(dev->uart.handle, 0);
     libusb_close(dev->uart.handle);
+    free(dev);
+}
+
+/*
+ * Lock memory and switch to SCHED_FIFO, so that page faults and other
+ * tasks do not stretch the protocol gaps. Threads started afterwards
+ * inherit the policy.
+ */
+static int realtime(int priority)
+{
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        perror("mlockall");
+        return -1;
+    }
+    struct sched_param param = { .sched_priority = priority };
+    int ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (ret != 0) {
+        fprintf(stderr, "Setting SCHED_FIFO priority %d failed: %s\n", priority, strerror(ret));
+        return -1;
+    }
+    return 0;
+}
+
+#define V850J_FX 5000000
+#define V850J_BAUD_RATE 9600
+#define V850J_MAX_BAUD_RATE 153600
+
+struct FlashJob {
+    /* Image to program, prepared while connecting; NULL if only connecting */
+    struct Preparation *prep;
+    bool delta;
+    /* VERIFY each block right after programming it */
+    bool verify;
+    /* Directory for per-board profiles, keyed by USB serial number */
+    const char *profile_dir;
+    bool autotune;
+    uint32_t max_baud_rate;
+    /* Reuse a bootloader session left running by the previous run */
+    bool resume;
+    /* Range to read back into dump_filename, if set */
+    const char *dump_filename;
+    uint32_t dump_start;
+    uint32_t dump_end;
+};
+
+static void profile_path(const struct FlashJob *job, struct V850Device *dev, const char *kind,
+                         char *buf, size_t size)
+{
+    snprintf(buf, size, "%s/%s.%s", job->profile_dir, dev->serial, kind);
 }
 
-static void test(struct V850Device *dev)
+/* Read back the job's range into a file mapping, frames land in place */
+static int dump(struct V850Device *dev, const struct FlashJob *job)
+{
+    size_t length = job->dump_end - job->dump_start + 1;
+    int fd = open(job->dump_filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(job->dump_filename);
+        return -1;
+    }
+    if (ftruncate(fd, length) != 0) {
+        perror(job->dump_filename);
+        close(fd);
+        return -1;
+    }
+    uint8_t *out = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (out == MAP_FAILED) {
+        perror(job->dump_filename);
+        return -1;
+    }
+    int ret = v850j_read(dev, job->dump_start, job->dump_end, out);
+    munmap(out, length);
+    return ret;
+}
+
+/* Full bring-up: 78K0 setup, bootloader entry and baud rate negotiation */
+static int handshake(struct V850Device *dev, const struct FlashJob *job)
 {
     int ret;
 
-    libusb_clear_halt(dev->uart.handle, 0x02);
-    libusb_clear_halt(dev->uart.handle, 0x81);
-    ret = usb_78k0_init(&dev->uart);
     printf("Doing control transfers...\n");
+    usb_78k0_batch_begin(&dev->uart);
     ret = v850j_78k0_open_close(&dev->uart, true);
     ret = v850j_78k0_set_dtr_rts(&dev->uart, true, true);
 
@@ -98,28 +223,256 @@ static void test(struct V850Device *dev)
     ret = v850j_78k0_set_err_chr(&dev->uart, false, '\0');
     ret = v850j_78k0_line_control(&dev->uart, 9600, line_settings);
     ret = v850j_78k0_set_err_chr(&dev->uart, false, '\0');
+    ret = usb_78k0_batch_end(&dev->uart);
 
-    printf("Resetting...\n");
-    ret = v850j_reset(dev);
-    if (ret != 0)
-        return;
-    printf("Setting oscillation frequency...\n");
-    ret = v850j_osc_frequency_set(dev, 5000000);
+    char path[PATH_MAX];
+    if (job->profile_dir != NULL) {
+        profile_path(job, dev, "timings", path, sizeof(path));
+    }
+    if (job->autotune) {
+        printf("Tuning timings...\n");
+        ret = v850j_autotune(dev, V850J_FX, V850J_BAUD_RATE);
+        if (ret != 0)
+            return ret;
+        if (job->profile_dir != NULL && v850j_timings_save(dev, path) == 0)
+            printf("Saved timings to %s\n", path);
+        ret = v850j_reenter(dev, V850J_FX);
+        if (ret != 0)
+            return ret;
+    } else {
+        printf("Resetting...\n");
+        ret = v850j_reset(dev);
+        if (ret != 0)
+            return ret;
+        printf("Setting oscillation frequency...\n");
+        ret = v850j_osc_frequency_set(dev, V850J_FX);
+        if (ret != 0)
+            return ret;
+    }
+    printf("Negotiating baud rate...\n");
+    uint32_t baud_rate;
+    ret = v850j_baud_rate_negotiate(dev, job->max_baud_rate, &baud_rate);
     if (ret != 0)
-        return;
-    printf("Setting baud rate...\n");
-    ret = v850j_baud_rate_set(dev, 9600);
-    //ret = v850j_baud_rate_set(dev, 38400);
-    //ret = v850j_baud_rate_set(dev, 115200);
+        return ret;
+    printf("Using %" PRIu32 " baud.\n", baud_rate);
+    if (job->resume && job->profile_dir != NULL) {
+        profile_path(job, dev, "session", path, sizeof(path));
+        v850j_session_save(dev, path);
+    }
+    return 0;
+}
+
+/* Record blocks in the journal once the device has verified them */
+static void journal_progress(void *opaque, uint32_t address, size_t length)
+{
+    struct Journal *journal = opaque;
+    for (size_t offset = 0; offset < length; offset += journal->block_size) {
+        journal_mark(journal, address + offset);
+    }
+}
+
+/*
+ * Erase and program the image. With a profile directory, programmed
+ * blocks are journaled, and an interrupted run continues with the
+ * blocks that are not yet on the device.
+ */
+static int program_image(struct V850Device *dev, const struct FlashJob *job, uint32_t block_size)
+{
+    const struct Preparation *prep = job->prep;
+    const struct Image *image = &prep->image;
+    /* Precomputed checksums are per image block, the device's may differ */
+    const uint16_t *sums = (prep->block_size == block_size) ? prep->sums : NULL;
+    struct Journal journal;
+    bool journaling = false;
+    if (job->profile_dir != NULL) {
+        char path[PATH_MAX];
+        profile_path(job, dev, "journal", path, sizeof(path));
+        journaling = journal_open(&journal, path, prep->hash, block_size,
+                                  dev->geometry.flash_size) == 0;
+    }
+
+    int ret = 0;
+    size_t done = 0;
+    size_t max_runs = image->length / block_size;
+    struct V850Range *runs = malloc(max_runs * sizeof(struct V850Range));
+    const uint8_t **run_data = malloc(max_runs * sizeof(uint8_t *));
+    size_t num_runs = 0;
+    for (size_t i = 0; i < image->num_chunks; i++) {
+        const struct ImageChunk *chunk = &image->chunks[i];
+        for (size_t offset = 0; offset < chunk->length; offset += block_size) {
+            uint32_t address = chunk->address + offset;
+            /* Journaled blocks only count if the device still agrees */
+            if (journaling && journal_done(&journal, address)) {
+                uint16_t sum;
+                ret = v850j_checksum(dev, address, address + block_size - 1, &sum);
+                if (ret != 0)
+                    goto out;
+                size_t index = (chunk->data + offset - image->buffer) / block_size;
+                uint16_t expected = (sums != NULL) ? sums[index]
+                                                   : -checksum_sum(chunk->data + offset, block_size);
+                if (sum == expected) {
+                    done++;
+                    continue;
+                }
+                journal_forget(&journal, address);
+            }
+            if (num_runs > 0 && runs[num_runs - 1].end + 1 == address) {
+                runs[num_runs - 1].end += block_size;
+                continue;
+            }
+            runs[num_runs].start = address;
+            runs[num_runs].end = address + block_size - 1;
+            run_data[num_runs] = chunk->data + offset;
+            num_runs++;
+        }
+    }
+    if (done > 0)
+        printf("Resuming, %zu blocks already programmed.\n", done);
+
+    printf("Erasing...\n");
+    /* A chip erase would wipe what the journal vouches for */
+    ret = v850j_erase_planned(dev, runs, num_runs, block_size, done == 0);
     if (ret != 0)
-        return;
-    printf("Getting silicon signature...\n");
-    ret = v850j_get_silicon_signature(dev);
+        goto out;
+    /* Erase times measured on this board guide the next plan */
+    if (job->profile_dir != NULL) {
+        char path[PATH_MAX];
+        profile_path(job, dev, "erase", path, sizeof(path));
+        v850j_erase_costs_save(dev, path);
+    }
+
+    if (journaling) {
+        dev->progress = journal_progress;
+        dev->progress_opaque = &journal;
+    }
+    for (size_t i = 0; i < num_runs && ret == 0; i++) {
+        size_t length = runs[i].end - runs[i].start + 1;
+        printf("Programming 0x%06" PRIX32 "-0x%06" PRIX32 "...\n", runs[i].start, runs[i].end);
+        if (job->verify) {
+            size_t index = (run_data[i] - image->buffer) / block_size;
+            ret = v850j_program_verify(dev, runs[i].start, run_data[i], length, block_size,
+                                       (sums != NULL) ? sums + index : NULL);
+            continue;
+        }
+        /*
+         * Internal verify only covers a whole PROGRAMMING command, so when
+         * journaling, issue one per block to record each as soon as it passed.
+         */
+        size_t step = journaling ? block_size : length;
+        for (size_t offset = 0; offset < length && ret == 0; offset += step) {
+            ret = v850j_program_frames(dev, runs[i].start + offset, step, &prep->frames,
+                                       (run_data[i] + offset - image->buffer) / V850J_DATA_FRAME_SIZE);
+        }
+    }
+    dev->progress = NULL;
+
+out:
+    if (journaling)
+        journal_close(&journal, ret == 0);
+    free(run_data);
+    free(runs);
+    return ret;
+}
+
+static int test(struct V850Device *dev, const struct FlashJob *job)
+{
+    int ret;
+
+    if (dev->uart.backend == NULL) {
+        libusb_clear_halt(dev->uart.handle, 0x02);
+        libusb_clear_halt(dev->uart.handle, 0x81);
+    }
+    ret = usb_78k0_init(&dev->uart);
+
+    char path[PATH_MAX];
+    /* Tuned timings serve a resumed session as well as a new handshake */
+    if (job->profile_dir != NULL) {
+        profile_path(job, dev, "timings", path, sizeof(path));
+        if (v850j_timings_load(dev, path) == 0)
+            printf("Loaded timings from %s\n", path);
+    }
+    bool warm = false;
+    if (job->resume && job->profile_dir != NULL) {
+        profile_path(job, dev, "session", path, sizeof(path));
+        if (v850j_session_load(dev, path) == 0) {
+            printf("Probing for a running bootloader at %" PRIu32 " baud...\n", dev->baud_rate);
+            warm = v850j_resume(dev) == 0;
+            if (!warm)
+                printf("No response, starting over.\n");
+        }
+    }
+    if (!warm) {
+        ret = handshake(dev, job);
+        if (ret != 0)
+            return ret;
+    }
+    if (job->profile_dir != NULL) {
+        profile_path(job, dev, "signature", path, sizeof(path));
+        /* Baud rate negotiation may have just read the real one */
+        if (dev->signature_valid)
+            v850j_signature_save(dev, path);
+        else if (v850j_signature_load(dev, path) == 0)
+            printf("Loaded signature from %s\n", path);
+    }
+    if (!dev->signature_valid) {
+        printf("Getting silicon signature...\n");
+        ret = v850j_get_silicon_signature(dev);
+        if (ret != 0)
+            return ret;
+        if (job->profile_dir != NULL)
+            v850j_signature_save(dev, path);
+    }
+    uint32_t block_size = dev->geometry.block_size;
+
+    if (job->dump_filename != NULL) {
+        printf("Reading 0x%06" PRIX32 "-0x%06" PRIX32 " into %s...\n",
+               job->dump_start, job->dump_end, job->dump_filename);
+        ret = dump(dev, job);
+        if (ret != 0)
+            return ret;
+    }
+
+    if (job->prep == NULL)
+        return 0;
+    ret = prepare_wait(job->prep);
     if (ret != 0)
-        return;
+        return ret;
+    const struct Image *image = &job->prep->image;
+    if (image->num_chunks == 0)
+        return 0;
+    const struct ImageChunk *last = &image->chunks[image->num_chunks - 1];
+    if (last->address + last->length > dev->geometry.flash_size) {
+        fprintf(stderr, "Image ends at 0x%06zX, beyond the %" PRIu32 " KB of flash.\n",
+                last->address + last->length - 1, dev->geometry.flash_size / 1024);
+        return -1;
+    }
+    if (job->profile_dir != NULL) {
+        profile_path(job, dev, "erase", path, sizeof(path));
+        v850j_erase_costs_load(dev, path);
+    }
+    if (job->delta) {
+        const uint16_t *sums = (job->prep->block_size == block_size) ? job->prep->sums : NULL;
+        for (size_t i = 0; i < image->num_chunks; i++) {
+            const struct ImageChunk *chunk = &image->chunks[i];
+            printf("Updating changed blocks of 0x%06" PRIX32 "-0x%06zX...\n",
+                   chunk->address, chunk->address + chunk->length - 1);
+            ret = v850j_program_delta(dev, chunk->address, chunk->data, chunk->length,
+                                      block_size, (sums != NULL)
+                                                  ? sums + (chunk->data - image->buffer) / block_size
+                                                  : NULL);
+            if (ret != 0)
+                return ret;
+        }
+    } else {
+        ret = program_image(dev, job, block_size);
+        if (ret != 0)
+            return ret;
+    }
+    printf("Programming done.\n");
+    return 0;
 }
 
-static void connect(libusb_context *usb_context)
+static void connect(libusb_context *usb_context, const struct FlashJob *job)
 {
     printf("Opening V850ES/Jx3-L device...\n");
     struct V850Device *dev = v850j_open(usb_context);
@@ -129,29 +482,243 @@ static void connect(libusb_context *usb_context)
     }
 
     // Avoid having to re-plug device for reproducible results
-    int ret = libusb_reset_device(dev->uart.handle);
-    if (ret != LIBUSB_SUCCESS) {
-        fprintf(stderr, "Resetting device failed: %d\n", ret);
-        return;
+    if (!job->resume) {
+        int ret = libusb_reset_device(dev->uart.handle);
+        if (ret != LIBUSB_SUCCESS) {
+            fprintf(stderr, "Resetting device failed: %d\n", ret);
+            return;
+        }
     }
 
-    test(dev);
-    v850j_78k0_open_close(&dev->uart, false);
+    test(dev, job);
+    /* Keep the UART open for the next run to resume */
+    if (!job->resume)
+        v850j_78k0_open_close(&dev->uart, false);
     v850j_close(dev);
 }
 
-int main(void)
+#ifdef __linux__
+/* Go through the kernel's upd78f0730 driver instead of claiming the device */
+static void connect_tty(const char *path, const struct FlashJob *job)
 {
+    printf("Opening V850ES/Jx3-L device at %s...\n", path);
+    struct V850Device *dev = calloc(1, sizeof(struct V850Device));
+    if (tty_78k0_open(&dev->uart, path) != 0) {
+        fprintf(stderr, "Opening the device failed.\n");
+        free(dev);
+        return;
+    }
+    if (tty_78k0_serial(path, dev->serial, sizeof(dev->serial)) != 0) {
+        const char *name = strrchr(path, '/');
+        snprintf(dev->serial, sizeof(dev->serial), "%s", (name != NULL) ? name + 1 : path);
+    }
+
+    test(dev, job);
+    if (!job->resume)
+        v850j_78k0_open_close(&dev->uart, false);
+    tty_78k0_close(&dev->uart);
+    free(dev);
+}
+#endif
+
+struct GangSlot {
+    pthread_t thread;
+    struct V850Device *dev;
+    const struct FlashJob *job;
     int ret;
-    libusb_context *usb_context;
-    ret = libusb_init(&usb_context);
-    if (ret != 0) {
-        fprintf(stderr, "USB init failed.\n");
+};
+
+static void *gang_thread(void *opaque)
+{
+    struct GangSlot *slot = opaque;
+
+    if (!slot->job->resume) {
+        slot->ret = libusb_reset_device(slot->dev->uart.handle);
+        if (slot->ret != LIBUSB_SUCCESS) {
+            fprintf(stderr, "Resetting device failed: %d\n", slot->ret);
+            return NULL;
+        }
+    }
+    slot->ret = test(slot->dev, slot->job);
+    if (!slot->job->resume)
+        v850j_78k0_open_close(&slot->dev->uart, false);
+    return NULL;
+}
+
+static void connect_all(libusb_context *usb_context, const struct FlashJob *job)
+{
+    libusb_device **list;
+    ssize_t count = libusb_get_device_list(usb_context, &list);
+    if (count < 0) {
+        fprintf(stderr, "Listing devices failed: %zd\n", count);
+        return;
+    }
+
+    struct GangSlot *slots = calloc(count, sizeof(struct GangSlot));
+    int num_slots = 0;
+    for (ssize_t i = 0; i < count; i++) {
+        struct libusb_device_descriptor desc;
+        if (libusb_get_device_descriptor(list[i], &desc) != LIBUSB_SUCCESS)
+            continue;
+        if (desc.idVendor != USB_VID_NEC || desc.idProduct != USB_PID_NEC_UART)
+            continue;
+        printf("Opening V850ES/Jx3-L device %d-%d...\n",
+               libusb_get_bus_number(list[i]), libusb_get_device_address(list[i]));
+        struct V850Device *dev = v850j_open_device(usb_context, list[i]);
+        if (dev == NULL) {
+            fprintf(stderr, "Opening the device failed.\n");
+            continue;
+        }
+        slots[num_slots].dev = dev;
+        slots[num_slots].job = job;
+        num_slots++;
+    }
+    libusb_free_device_list(list, 1);
+
+    /* Each board only waits on its own link, so run them side by side */
+    for (int i = 0; i < num_slots; i++) {
+        pthread_create(&slots[i].thread, NULL, gang_thread, &slots[i]);
+    }
+    int failed = 0;
+    for (int i = 0; i < num_slots; i++) {
+        pthread_join(slots[i].thread, NULL);
+        if (slots[i].ret != 0)
+            failed++;
+        v850j_close(slots[i].dev);
+    }
+    printf("%d of %d devices succeeded.\n", num_slots - failed, num_slots);
+    free(slots);
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+    struct FlashJob job = { NULL, false, false, NULL, false, V850J_MAX_BAUD_RATE, false, NULL, 0, 0 };
+    bool gang = false;
+    const char *tty_path = NULL;
+    const char *trace_filename = NULL;
+    bool stats_summary = false;
+    const char *stats_filename = NULL;
+    size_t trace_ring_size = 0;
+    int priority = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:dD:gj:p:P:r:R:St:TVw")) != -1) {
+        switch (opt) {
+        case 'b':
+            job.max_baud_rate = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            job.delta = true;
+            break;
+#ifdef __linux__
+        case 'D':
+            tty_path = optarg;
+            break;
+#endif
+        case 'g':
+            gang = true;
+            break;
+        case 'j':
+            stats_filename = optarg;
+            break;
+        case 'p':
+            job.profile_dir = optarg;
+            break;
+        case 'P':
+            priority = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            trace_ring_size = strtoul(optarg, NULL, 0) * 1024;
+            break;
+        case 'R': {
+            int pos = 0;
+            if (sscanf(optarg, "%" SCNx32 "-%" SCNx32 ":%n", &job.dump_start, &job.dump_end, &pos) != 2 ||
+                pos == 0 || optarg[pos] == '\0' || job.dump_end < job.dump_start) {
+                fprintf(stderr, "Invalid read-back range: %s\n", optarg);
+                return -1;
+            }
+            job.dump_filename = optarg + pos;
+            break;
+        }
+        case 'S':
+            stats_summary = true;
+            break;
+        case 't':
+            trace_filename = optarg;
+            break;
+        case 'T':
+            job.autotune = true;
+            break;
+        case 'V':
+            job.verify = true;
+            break;
+        case 'w':
+            job.resume = true;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-b max_baud_rate] [-d] [-D /dev/ttyUSBn | -g] [-p profile_dir [-w]] [-T] [-V]\n"
+                            "          [-t trace.bin [-r ring_kb]] [-S] [-j stats.json] [-P rt_priority]\n"
+                            "          [-R start-end:dump.bin] [image]\n", argv[0]);
+            return -1;
+        }
+    }
+    if (job.resume && job.profile_dir == NULL) {
+        fprintf(stderr, "Resuming needs a profile directory for session files.\n");
+        return -1;
+    }
+    if (gang && tty_path != NULL) {
+        fprintf(stderr, "Gang mode needs libusb, not a tty.\n");
+        return -1;
+    }
+    if (gang && job.dump_filename != NULL) {
+        fprintf(stderr, "Reading back is not supported in gang mode.\n");
         return -1;
     }
 
-    connect(usb_context);
+    /* Load and encode the image on other cores while the board connects */
+    struct Preparation prep;
+    if (optind < argc) {
+        if (prepare_start(&prep, argv[optind], V850ESJx3L_BLOCK_SIZE,
+                          V850ESJx3L_ADDRESS_LIMIT) != 0)
+            return -1;
+        job.prep = &prep;
+    }
+
+    if (trace_filename != NULL && trace_open(trace_filename, trace_ring_size) != 0)
+        return -1;
+
+    if (priority > 0 && realtime(priority) != 0)
+        fprintf(stderr, "Continuing without real-time scheduling.\n");
 
-    libusb_exit(usb_context);
+    stats_enabled = stats_summary || stats_filename != NULL;
+    stats_reset();
+
+#ifdef __linux__
+    if (tty_path != NULL) {
+        connect_tty(tty_path, &job);
+    } else
+#endif
+    {
+        libusb_context *usb_context;
+        ret = libusb_init(&usb_context);
+        if (ret != 0) {
+            fprintf(stderr, "USB init failed.\n");
+            return -1;
+        }
+
+        if (gang)
+            connect_all(usb_context, &job);
+        else
+            connect(usb_context, &job);
+
+        libusb_exit(usb_context);
+    }
+    trace_close();
+    if (stats_summary)
+        stats_print(stderr, v850j_stats_name);
+    if (stats_filename != NULL)
+        stats_save(stats_filename, v850j_stats_name);
+    if (job.prep != NULL)
+        prepare_free(job.prep);
     return 0;
 }
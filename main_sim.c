@@ -0,0 +1,327 @@
+/*
+ * Flash cycle benchmark against a simulated V850ES/Jx3-L bootloader
+ *
+ * Copyright (c) 2011-2012 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU GPL version 2 or (at your option) any later version.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <libusb-1.0/libusb.h>
+#include "v850j.h"
+#include "v850j_async.h"
+#include "v850j_sim.h"
+#include "checksum.h"
+#include "trace.h"
+#include "stats.h"
+
+#define SIM_DEVICE_NAME "D70F3738"
+#define SIM_FLASH_SIZE  (256 * 1024)
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int handshake(struct V850Device *dev, uint32_t *baud_rate, bool autotune, bool negotiate)
+{
+    int ret;
+
+    ret = usb_78k0_init(&dev->uart);
+    ret = v850j_78k0_open_close(&dev->uart, true);
+    ret = v850j_78k0_set_dtr_rts(&dev->uart, true, true);
+
+    if (autotune) {
+        ret = v850j_autotune(dev, 5000000, *baud_rate);
+        if (ret != 0)
+            return ret;
+    }
+    if (negotiate) {
+        ret = v850j_reenter(dev, 5000000);
+        if (ret != 0)
+            return ret;
+        return v850j_baud_rate_negotiate(dev, *baud_rate, baud_rate);
+    }
+    ret = v850j_connect(dev, 5000000, *baud_rate);
+    if (ret != 0)
+        return ret;
+    return v850j_get_silicon_signature(dev);
+}
+
+#ifdef __linux__
+struct AsyncBoard {
+    struct V850Sim *sim;
+    struct V850Device *dev;
+    struct V850Async *async;
+    const uint8_t *image;
+    size_t image_length;
+    uint16_t sum;
+    int ret;
+};
+
+static void board_checked(struct V850Async *async, int ret, void *opaque)
+{
+    struct AsyncBoard *board = opaque;
+    board->ret = ret;
+    if (ret == 0 && board->sum != (uint16_t)-checksum_sum(board->image, board->image_length)) {
+        fprintf(stderr, "Checksum mismatch: %04" PRIX16 "\n", board->sum);
+        board->ret = -1;
+    }
+}
+
+static void board_programmed(struct V850Async *async, int ret, void *opaque)
+{
+    struct AsyncBoard *board = opaque;
+    board->ret = ret;
+    if (ret == 0)
+        board->ret = v850j_async_checksum(async, 0x000000, board->image_length - 1, &board->sum,
+                                          board_checked, board);
+}
+
+static void board_erased(struct V850Async *async, int ret, void *opaque)
+{
+    struct AsyncBoard *board = opaque;
+    board->ret = ret;
+    if (ret == 0)
+        board->ret = v850j_async_program(async, 0x000000, board->image, board->image_length,
+                                         board_programmed, board);
+}
+
+/* Erase, program and checksum all boards at once from a single thread */
+static int bench_async(int boards, const uint8_t *image, size_t image_length,
+                       uint32_t baud_rate, uint32_t board_baud_rate)
+{
+    struct AsyncBoard *board = calloc(boards, sizeof(struct AsyncBoard));
+    struct V850Loop *loop = v850j_loop_new(NULL);
+    int ret = -1;
+    if (loop == NULL)
+        goto out;
+
+    double t0 = now();
+    for (int i = 0; i < boards; i++) {
+        board[i].sim = v850j_sim_new(SIM_DEVICE_NAME, SIM_FLASH_SIZE, board_baud_rate);
+        board[i].dev = calloc(1, sizeof(struct V850Device));
+        board[i].image = image;
+        board[i].image_length = image_length;
+        v850j_sim_attach(board[i].sim, &board[i].dev->uart);
+        uint32_t rate = baud_rate;
+        if (handshake(board[i].dev, &rate, false, false) != 0) {
+            fprintf(stderr, "Handshake %d failed.\n", i);
+            goto out;
+        }
+        board[i].async = v850j_async_new(loop, board[i].dev);
+        if (board[i].async == NULL)
+            goto out;
+    }
+
+    double t1 = now();
+    for (int i = 0; i < boards; i++) {
+        board[i].ret = v850j_async_block_erase(board[i].async, 0x000000, image_length - 1,
+                                               board_erased, &board[i]);
+    }
+    if (v850j_loop_run(loop) != 0)
+        goto out;
+    double t2 = now();
+
+    int failed = 0;
+    for (int i = 0; i < boards; i++) {
+        if (board[i].ret != 0 ||
+            memcmp(v850j_sim_flash(board[i].sim), image, image_length) != 0) {
+            fprintf(stderr, "Board %d failed.\n", i);
+            failed++;
+        }
+    }
+    printf("Handshakes:  %8.3f s (%d boards, one at a time)\n", t1 - t0, boards);
+    printf("Async:       %8.3f s (%d boards, %.0f bytes/s in total)\n",
+           t2 - t1, boards, boards * image_length / (t2 - t1));
+    ret = (failed == 0) ? 0 : -1;
+
+out:
+    for (int i = 0; i < boards; i++) {
+        if (board[i].async != NULL)
+            v850j_async_free(board[i].async);
+        free(board[i].dev);
+        if (board[i].sim != NULL)
+            v850j_sim_free(board[i].sim);
+    }
+    if (loop != NULL)
+        v850j_loop_free(loop);
+    free(board);
+    return ret;
+}
+#endif
+
+int main(int argc, char **argv)
+{
+    uint32_t baud_rate = 153600;
+    size_t image_length = 64 * 1024;
+    uint32_t board_baud_rate = 153600;
+    bool autotune = false;
+    bool negotiate = false;
+    bool verify = false;
+    const char *trace_filename = NULL;
+    bool stats_summary = false;
+    const char *stats_filename = NULL;
+    int async_boards = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "A:b:j:m:Ns:St:TV")) != -1) {
+        switch (opt) {
+#ifdef __linux__
+        case 'A':
+            async_boards = strtoul(optarg, NULL, 0);
+            break;
+#endif
+        case 'b':
+            baud_rate = strtoul(optarg, NULL, 0);
+            break;
+        case 'j':
+            stats_filename = optarg;
+            break;
+        case 'm':
+            board_baud_rate = strtoul(optarg, NULL, 0);
+            break;
+        case 'N':
+            negotiate = true;
+            break;
+        case 's':
+            image_length = strtoul(optarg, NULL, 0);
+            break;
+        case 'S':
+            stats_summary = true;
+            break;
+        case 't':
+            trace_filename = optarg;
+            break;
+        case 'T':
+            autotune = true;
+            break;
+        case 'V':
+            verify = true;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-A boards] [-b baud_rate] [-j stats.json] [-m board_max_baud_rate] [-N]\n"
+                            "          [-s image_size] [-S] [-t trace.bin] [-T] [-V]\n", argv[0]);
+            return -1;
+        }
+    }
+    if (image_length == 0 || image_length > SIM_FLASH_SIZE ||
+        (image_length % V850ESJx3L_BLOCK_SIZE) != 0) {
+        fprintf(stderr, "Image size must be a multiple of %d up to %d\n",
+                V850ESJx3L_BLOCK_SIZE, SIM_FLASH_SIZE);
+        return -1;
+    }
+    /* Frame parser and block sums take whichever kernel the CPU supports */
+    if (checksum_self_test() != 0) {
+        fprintf(stderr, "Checksum kernels disagree.\n");
+        return -1;
+    }
+
+    if (trace_filename != NULL && trace_open(trace_filename, 0) != 0)
+        return -1;
+    stats_enabled = stats_summary || stats_filename != NULL;
+
+    uint8_t *image = malloc(image_length);
+    srand(0);
+    for (size_t i = 0; i < image_length; i++) {
+        image[i] = rand();
+    }
+
+#ifdef __linux__
+    if (async_boards > 0) {
+        stats_reset();
+        int ret = bench_async(async_boards, image, image_length, baud_rate, board_baud_rate);
+        if (ret == 0 && stats_summary)
+            stats_print(stdout, v850j_stats_name);
+        if (ret == 0 && stats_filename != NULL)
+            ret = stats_save(stats_filename, v850j_stats_name);
+        trace_close();
+        free(image);
+        return ret;
+    }
+#endif
+
+    struct V850Sim *sim = v850j_sim_new(SIM_DEVICE_NAME, SIM_FLASH_SIZE, board_baud_rate);
+    struct V850Device *dev = calloc(1, sizeof(struct V850Device));
+    v850j_sim_attach(sim, &dev->uart);
+
+    int ret = -1;
+    uint8_t *readback = NULL;
+    uint32_t tune_baud_rate = baud_rate;
+    if (autotune && handshake(dev, &tune_baud_rate, true, false) != 0) {
+        fprintf(stderr, "Tuning failed.\n");
+        goto out;
+    }
+    stats_reset();
+    double t0 = now();
+    if (handshake(dev, &baud_rate, false, negotiate) != 0) {
+        fprintf(stderr, "Handshake failed.\n");
+        goto out;
+    }
+    double t1 = now();
+    struct V850Range footprint = { 0x000000, image_length - 1 };
+    if (v850j_erase_planned(dev, &footprint, 1, V850ESJx3L_BLOCK_SIZE, true) != 0 ||
+        (verify ? v850j_program_verify(dev, 0x000000, image, image_length, V850ESJx3L_BLOCK_SIZE,
+                                         NULL)
+                : v850j_program(dev, 0x000000, image, image_length)) != 0) {
+        fprintf(stderr, "Programming failed.\n");
+        goto out;
+    }
+    double t2 = now();
+    if (memcmp(v850j_sim_flash(sim), image, image_length) != 0) {
+        fprintf(stderr, "Flash contents differ from image.\n");
+        goto out;
+    }
+
+    /* Incremental update touching a single block */
+    image[image_length / 2] ^= 0xff;
+    if (v850j_program_delta(dev, 0x000000, image, image_length, V850ESJx3L_BLOCK_SIZE, NULL) != 0) {
+        fprintf(stderr, "Delta programming failed.\n");
+        goto out;
+    }
+    double t3 = now();
+    if (memcmp(v850j_sim_flash(sim), image, image_length) != 0) {
+        fprintf(stderr, "Flash contents differ from updated image.\n");
+        goto out;
+    }
+
+    readback = malloc(image_length);
+    double t4 = now();
+    if (v850j_read(dev, 0x000000, image_length - 1, readback) != 0) {
+        fprintf(stderr, "Reading back failed.\n");
+        goto out;
+    }
+    double t5 = now();
+    if (memcmp(readback, image, image_length) != 0) {
+        fprintf(stderr, "Read back contents differ from image.\n");
+        goto out;
+    }
+
+    printf("Handshake:   %8.3f s\n", t1 - t0);
+    printf("Program:     %8.3f s (%zu bytes, %.0f bytes/s at %" PRIu32 " baud)\n",
+           t2 - t1, image_length, image_length / (t2 - t1), baud_rate);
+    printf("Delta:       %8.3f s\n", t3 - t2);
+    printf("Read:        %8.3f s (%.0f bytes/s)\n", t5 - t4, image_length / (t5 - t4));
+    /* Without the host-side comparisons between the phases */
+    printf("Total:       %8.3f s\n", (t3 - t0) + (t5 - t4));
+    if (stats_summary)
+        stats_print(stdout, v850j_stats_name);
+    if (stats_filename != NULL && stats_save(stats_filename, v850j_stats_name) != 0)
+        goto out;
+    ret = 0;
+
+out:
+    trace_close();
+    free(dev);
+    v850j_sim_free(sim);
+    free(readback);
+    free(image);
+    return ret;
+}
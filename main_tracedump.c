@@ -0,0 +1,162 @@
+/*
+ * Decoder for 78K0 UART trace captures of V850ES/Jx3-L sessions
+ *
+ * Copyright (c) 2011-2012 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU GPL version 2 or (at your option) any later version.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <libusb-1.0/libusb.h>
+#include "v850j.h"
+#include "trace.h"
+#include "bswap.h"
+
+static const char *request_name(uint8_t request)
+{
+    switch (request) {
+    case USB_78K0_REQUEST_LINE_CONTROL:     return "LINE_CONTROL";
+    case USB_78K0_REQUEST_SET_DTR_RTS:      return "SET_DTR_RTS";
+    case USB_78K0_REQUEST_SET_XON_XOFF_CHR: return "SET_XON_XOFF_CHR";
+    case USB_78K0_REQUEST_OPEN_CLOSE:       return "OPEN_CLOSE";
+    case USB_78K0_REQUEST_SET_ERR_CHR:      return "SET_ERR_CHR";
+    default:                                return "?";
+    }
+}
+
+/* Time of the record being decoded, relative to the first one */
+static double record_time;
+
+static void stamp(void)
+{
+    printf("%12.6f ", record_time);
+}
+
+static void print_hex(const uint8_t *data, size_t length, size_t max)
+{
+    for (size_t i = 0; i < length && i < max; i++) {
+        printf(" %02" PRIX8, data[i]);
+    }
+    if (length > max)
+        printf(" ...");
+}
+
+static void print_frame(const char *dir, const struct V850Frame *frame)
+{
+    stamp();
+    if (frame->type == V850ESJx3L_SOH) {
+        const char *name = v850j_command_name(frame->data[0]);
+        if (name != NULL) {
+            printf("%s %s", dir, name);
+        } else {
+            printf("%s command %02" PRIX8, dir, frame->data[0]);
+        }
+        print_hex(frame->data + 1, frame->length - 1, 16);
+        printf("\n");
+        return;
+    }
+
+    /* Status frames carry one or two status codes */
+    bool status = frame->length <= 2;
+    for (size_t i = 0; i < frame->length && status; i++) {
+        status = v850j_status_name(frame->data[i]) != NULL;
+    }
+    if (status) {
+        printf("%s status", dir);
+        for (size_t i = 0; i < frame->length; i++) {
+            printf(" %s", v850j_status_name(frame->data[i]));
+        }
+        printf("\n");
+        return;
+    }
+    printf("%s data (%zu, %s):", dir, frame->length,
+           (frame->end == V850ESJx3L_ETX) ? "ETX" : "ETB");
+    print_hex(frame->data, frame->length, 16);
+    printf("\n");
+}
+
+static void decode(const char *dir, struct V850FrameParser *parser, const uint8_t *data,
+                   size_t length)
+{
+    while (length > 0) {
+        size_t consumed;
+        const struct V850Frame *frame;
+        int ret = v850j_frame_parse(parser, data, length, &consumed, &frame);
+        if (ret == 1) {
+            print_frame(dir, frame);
+        } else if (ret == V850J_FRAME_ERROR_START) {
+            stamp();
+            printf("%s raw %02" PRIX8 "\n", dir, data[consumed - 1]);
+        } else if (ret < 0) {
+            stamp();
+            printf("%s invalid frame (%d)\n", dir, ret);
+        }
+        data += consumed;
+        length -= consumed;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s trace.bin\n", argv[0]);
+        return -1;
+    }
+    FILE *f = fopen(argv[1], "rb");
+    if (f == NULL) {
+        perror(argv[1]);
+        return -1;
+    }
+    char magic[8];
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+        memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+        fprintf(stderr, "%s: not a trace capture\n", argv[1]);
+        fclose(f);
+        return -1;
+    }
+
+    struct V850FrameParser tx = { 0 }, rx = { 0 };
+    uint64_t start = 0;
+    struct TraceRecord rec;
+    uint8_t data[UINT16_MAX];
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        uint16_t length = le16_to_cpu(rec.length);
+        if (fread(data, 1, length, f) != length)
+            break;
+        uint64_t t = le64_to_cpu(rec.timestamp_ns);
+        if (start == 0)
+            start = t;
+        record_time = (t - start) / 1e9;
+        switch (rec.kind) {
+        case TRACE_CONTROL:
+            stamp();
+            printf("78K0 %s", request_name(data[0]));
+            print_hex(data + 1, length - 1, 16);
+            printf("\n");
+            break;
+        case TRACE_TX:
+            decode("->", &tx, data, length);
+            break;
+        case TRACE_RX:
+            decode("<-", &rx, data, length);
+            break;
+        case TRACE_WAIT: {
+            uint32_t us;
+            memcpy(&us, data, sizeof(us));
+            stamp();
+            printf("wait %" PRIu32 " us\n", le32_to_cpu(us));
+            break;
+        }
+        default:
+            stamp();
+            printf("record %02" PRIX8 " (%u bytes)\n", rec.kind, length);
+            break;
+        }
+    }
+    fclose(f);
+    return 0;
+}
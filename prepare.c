@@ -0,0 +1,149 @@
+/*
+ * Image preparation on worker threads
+ *
+ * Copyright (c) 2011-2012 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU LGPL version 2.1 or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libusb-1.0/libusb.h>
+#include "prepare.h"
+#include "checksum.h"
+
+#define PREPARE_MAX_WORKERS 8
+
+/* Blocks [first, first + count) of the image */
+struct Slice {
+    struct Preparation *prep;
+    pthread_t thread;
+    size_t first;
+    size_t count;
+};
+
+static void *prepare_slice(void *opaque)
+{
+    struct Slice *slice = opaque;
+    struct Preparation *prep = slice->prep;
+    size_t frames_per_block = prep->block_size / V850J_DATA_FRAME_SIZE;
+
+    for (size_t b = slice->first; b < slice->first + slice->count; b++) {
+        const uint8_t *block = prep->image.buffer + b * prep->block_size;
+        prep->sums[b] = -checksum_sum(block, prep->block_size);
+        /* Only the buffer's last frame ends in ETX, a range's last gets it when sent */
+        for (size_t i = 0; i < frames_per_block; i++) {
+            v850j_data_frames_encode(&prep->frames, b * frames_per_block + i,
+                                     prep->image.buffer, prep->image.length);
+        }
+    }
+    return NULL;
+}
+
+static int prepare_blocks(struct Preparation *prep)
+{
+    size_t blocks = prep->image.length / prep->block_size;
+    if (blocks == 0)
+        return 0;
+    size_t count = prep->image.length / V850J_DATA_FRAME_SIZE;
+    prep->sums = malloc(blocks * sizeof(uint16_t));
+    prep->frames.frames = malloc(count * V850J_FRAME_BUFFER_SIZE);
+    prep->frames.lengths = malloc(count * sizeof(size_t));
+    prep->frames.count = count;
+    if (prep->sums == NULL || prep->frames.frames == NULL || prep->frames.lengths == NULL) {
+        fprintf(stderr, "%s: out of memory\n", __func__);
+        return -1;
+    }
+
+    int workers = prep->workers;
+    if ((size_t)workers > blocks)
+        workers = blocks;
+    struct Slice slices[PREPARE_MAX_WORKERS];
+    size_t first = 0;
+    for (int i = 0; i < workers; i++) {
+        slices[i].prep = prep;
+        slices[i].first = first;
+        slices[i].count = blocks / workers + ((size_t)i < blocks % workers ? 1 : 0);
+        first += slices[i].count;
+    }
+    /* The first slice runs here, and so does the hash once it is done */
+    int started;
+    for (started = 1; started < workers; started++) {
+        if (pthread_create(&slices[started].thread, NULL, prepare_slice, &slices[started]) != 0)
+            break;
+    }
+    for (int i = started; i < workers; i++) {
+        prepare_slice(&slices[i]);
+    }
+    if (workers > 0)
+        prepare_slice(&slices[0]);
+    prep->hash = image_hash(&prep->image);
+    for (int i = 1; i < started; i++) {
+        pthread_join(slices[i].thread, NULL);
+    }
+    return 0;
+}
+
+static void *prepare_thread(void *opaque)
+{
+    struct Preparation *prep = opaque;
+
+    int ret = image_load(&prep->image, prep->filename, prep->block_size, prep->limit);
+    if (ret == 0)
+        ret = prepare_blocks(prep);
+
+    pthread_mutex_lock(&prep->lock);
+    prep->ret = ret;
+    prep->done = true;
+    pthread_cond_broadcast(&prep->cond);
+    pthread_mutex_unlock(&prep->lock);
+    return NULL;
+}
+
+int prepare_start(struct Preparation *prep, const char *filename, size_t block_size,
+                  uint64_t limit)
+{
+    memset(prep, 0, sizeof(*prep));
+    prep->filename = filename;
+    prep->block_size = block_size;
+    prep->limit = limit;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    prep->workers = (cpus < 1) ? 1 : (cpus > PREPARE_MAX_WORKERS) ? PREPARE_MAX_WORKERS : cpus;
+    pthread_mutex_init(&prep->lock, NULL);
+    pthread_cond_init(&prep->cond, NULL);
+
+    int ret = pthread_create(&prep->thread, NULL, prepare_thread, prep);
+    if (ret != 0) {
+        fprintf(stderr, "%s: starting worker failed: %s\n", __func__, strerror(ret));
+        pthread_cond_destroy(&prep->cond);
+        pthread_mutex_destroy(&prep->lock);
+        return -1;
+    }
+    return 0;
+}
+
+int prepare_wait(struct Preparation *prep)
+{
+    pthread_mutex_lock(&prep->lock);
+    if (!prep->done)
+        printf("Waiting for %s to be prepared...\n", prep->filename);
+    while (!prep->done) {
+        pthread_cond_wait(&prep->cond, &prep->lock);
+    }
+    int ret = prep->ret;
+    pthread_mutex_unlock(&prep->lock);
+    return ret;
+}
+
+void prepare_free(struct Preparation *prep)
+{
+    pthread_join(prep->thread, NULL);
+    pthread_cond_destroy(&prep->cond);
+    pthread_mutex_destroy(&prep->lock);
+    free(prep->frames.lengths);
+    free(prep->frames.frames);
+    free(prep->sums);
+    image_free(&prep->image);
+}
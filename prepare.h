@@ -0,0 +1,53 @@
+/*
+ * Image preparation on worker threads
+ *
+ * Copyright (c) 2011-2012 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU LGPL version 2.1 or (at your option) any later version.
+ */
+#ifndef PREPARE_H
+#define PREPARE_H
+
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "image.h"
+#include "v850j.h"
+
+
+/*
+ * An image being loaded, checksummed per block and encoded into data
+ * frames in the background. The fields below the lock are only valid
+ * once prepare_wait() has returned 0.
+ */
+struct Preparation {
+    const char *filename;
+    size_t block_size;
+    /* End of the flash address space, see image_load() */
+    uint64_t limit;
+    int workers;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool done;
+    int ret;
+
+    struct Image image;
+    uint64_t hash;
+    /* Expected block checksums, one per block_size of image.buffer */
+    uint16_t *sums;
+    /* Data frames, one per 256 bytes of image.buffer */
+    struct V850DataFrames frames;
+};
+
+int prepare_start(struct Preparation *prep, const char *filename, size_t block_size,
+                  uint64_t limit);
+/* Block until the image is ready, may be called from several threads */
+int prepare_wait(struct Preparation *prep);
+void prepare_free(struct Preparation *prep);
+
+
+#endif
@@ -0,0 +1,181 @@
+/*
+ * Latency and throughput statistics for flash sessions
+ *
+ * Copyright (c) 2011-2012 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU LGPL version 2.1 or (at your option) any later version.
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+
+struct StatsLatency {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t histogram[STATS_HISTOGRAM_BUCKETS];
+};
+
+static struct {
+    uint64_t start_ns;
+    uint64_t timer_ns[STATS_TIMERS];
+    uint64_t timer_count[STATS_TIMERS];
+    uint64_t counter[STATS_COUNTERS];
+    struct StatsLatency latency[STATS_LATENCY_SLOTS];
+} stats;
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+int stats_enabled;
+
+static const char *timer_names[STATS_TIMERS] = {
+    [STATS_SLEEP]       = "sleep",
+    [STATS_CONTROL]     = "control",
+    [STATS_BULK_WRITE]  = "bulk_write",
+    [STATS_BULK_READ]   = "bulk_read",
+};
+
+static const char *counter_names[STATS_COUNTERS] = {
+    [STATS_PIPE_RETRIES]    = "pipe_retries",
+    [STATS_TIMEOUTS]        = "timeouts",
+    [STATS_BYTES_WRITTEN]   = "bytes_written",
+    [STATS_BYTES_READ]      = "bytes_read",
+};
+
+uint64_t stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_reset(void)
+{
+    pthread_mutex_lock(&stats_mutex);
+    memset(&stats, 0, sizeof(stats));
+    stats.start_ns = stats_now();
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+void stats_record_time(enum StatsTimer timer, uint64_t start)
+{
+    uint64_t elapsed = stats_now() - start;
+    pthread_mutex_lock(&stats_mutex);
+    stats.timer_ns[timer] += elapsed;
+    stats.timer_count[timer]++;
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+void stats_record_count(enum StatsCounter counter, uint64_t n)
+{
+    pthread_mutex_lock(&stats_mutex);
+    stats.counter[counter] += n;
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+void stats_record_latency(int slot, uint64_t start)
+{
+    uint64_t elapsed = stats_now() - start;
+    uint64_t us = elapsed / 1000;
+    int bucket = (us == 0) ? 0 : (63 - __builtin_clzll(us));
+    if (bucket >= STATS_HISTOGRAM_BUCKETS)
+        bucket = STATS_HISTOGRAM_BUCKETS - 1;
+
+    pthread_mutex_lock(&stats_mutex);
+    struct StatsLatency *l = &stats.latency[slot];
+    l->count++;
+    l->total_ns += elapsed;
+    if (elapsed > l->max_ns)
+        l->max_ns = elapsed;
+    l->histogram[bucket]++;
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+static double session_seconds(void)
+{
+    return (stats_now() - stats.start_ns) / 1e9;
+}
+
+void stats_print(FILE *f, StatsNameFunc *name)
+{
+    pthread_mutex_lock(&stats_mutex);
+    double elapsed = session_seconds();
+    fprintf(f, "Session: %.3f s\n", elapsed);
+    for (int i = 0; i < STATS_TIMERS; i++) {
+        fprintf(f, "  %-12s %10.3f ms in %" PRIu64 " calls\n", timer_names[i],
+                stats.timer_ns[i] / 1e6, stats.timer_count[i]);
+    }
+    for (int i = 0; i < STATS_COUNTERS; i++) {
+        fprintf(f, "  %-12s %10" PRIu64 "\n", counter_names[i], stats.counter[i]);
+    }
+    fprintf(f, "  write rate   %10.0f bytes/s\n", stats.counter[STATS_BYTES_WRITTEN] / elapsed);
+    fprintf(f, "  read rate    %10.0f bytes/s\n", stats.counter[STATS_BYTES_READ] / elapsed);
+
+    fprintf(f, "Latency (us):          count        avg        max\n");
+    for (int i = 0; i < STATS_LATENCY_SLOTS; i++) {
+        struct StatsLatency *l = &stats.latency[i];
+        if (l->count == 0)
+            continue;
+        fprintf(f, "  %-18s %8" PRIu64 " %10.1f %10.1f\n", name(i), l->count,
+                l->total_ns / 1e3 / l->count, l->max_ns / 1e3);
+        for (int b = 0; b < STATS_HISTOGRAM_BUCKETS; b++) {
+            if (l->histogram[b] == 0)
+                continue;
+            fprintf(f, "    %10" PRIu64 "-%-10" PRIu64 " %8" PRIu64 "\n",
+                    (b == 0) ? 0 : (UINT64_C(1) << b), (UINT64_C(1) << (b + 1)) - 1,
+                    l->histogram[b]);
+        }
+    }
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+void stats_print_json(FILE *f, StatsNameFunc *name)
+{
+    pthread_mutex_lock(&stats_mutex);
+    double elapsed = session_seconds();
+    fprintf(f, "{\n  \"session_s\": %.6f,\n  \"timers\": {", elapsed);
+    for (int i = 0; i < STATS_TIMERS; i++) {
+        fprintf(f, "%s\n    \"%s\": { \"ms\": %.3f, \"calls\": %" PRIu64 " }", i ? "," : "",
+                timer_names[i], stats.timer_ns[i] / 1e6, stats.timer_count[i]);
+    }
+    fprintf(f, "\n  },\n  \"counters\": {");
+    for (int i = 0; i < STATS_COUNTERS; i++) {
+        fprintf(f, "%s\n    \"%s\": %" PRIu64, i ? "," : "", counter_names[i], stats.counter[i]);
+    }
+    fprintf(f, "\n  },\n  \"write_bytes_per_s\": %.1f,\n  \"read_bytes_per_s\": %.1f,\n",
+            stats.counter[STATS_BYTES_WRITTEN] / elapsed, stats.counter[STATS_BYTES_READ] / elapsed);
+    fprintf(f, "  \"latency\": {");
+    bool first = true;
+    for (int i = 0; i < STATS_LATENCY_SLOTS; i++) {
+        struct StatsLatency *l = &stats.latency[i];
+        if (l->count == 0)
+            continue;
+        fprintf(f, "%s\n    \"%s\": { \"count\": %" PRIu64 ", \"avg_us\": %.1f, \"max_us\": %.1f,"
+                " \"histogram_log2_us\": [", first ? "" : ",", name(i), l->count,
+                l->total_ns / 1e3 / l->count, l->max_ns / 1e3);
+        for (int b = 0; b < STATS_HISTOGRAM_BUCKETS; b++) {
+            fprintf(f, "%s%" PRIu64, b ? ", " : "", l->histogram[b]);
+        }
+        fprintf(f, "] }");
+        first = false;
+    }
+    fprintf(f, "\n  }\n}\n");
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+int stats_save(const char *filename, StatsNameFunc *name)
+{
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) {
+        fprintf(stderr, "%s: opening %s failed\n", __func__, filename);
+        return -1;
+    }
+    stats_print_json(f, name);
+    if (fclose(f) != 0) {
+        fprintf(stderr, "%s: writing %s failed\n", __func__, filename);
+        return -1;
+    }
+    return 0;
+}
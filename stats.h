@@ -0,0 +1,75 @@
+/*
+ * Latency and throughput statistics for flash sessions
+ *
+ * Copyright (c) 2011-2012 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU LGPL version 2.1 or (at your option) any later version.
+ */
+#ifndef STATS_H
+#define STATS_H
+
+
+#include <stdint.h>
+#include <stdio.h>
+
+
+enum StatsTimer {
+    STATS_SLEEP,
+    STATS_CONTROL,
+    STATS_BULK_WRITE,
+    STATS_BULK_READ,
+    STATS_TIMERS,
+};
+
+enum StatsCounter {
+    STATS_PIPE_RETRIES,
+    STATS_TIMEOUTS,
+    STATS_BYTES_WRITTEN,
+    STATS_BYTES_READ,
+    STATS_COUNTERS,
+};
+
+/* Latency slots: command bytes, plus one for data frames */
+#define STATS_DATA_FRAME 256
+#define STATS_LATENCY_SLOTS 257
+/* Bucket i counts latencies of [2^i, 2^(i+1)) microseconds */
+#define STATS_HISTOGRAM_BUCKETS 32
+
+/* Set for -S or -j; until then nothing is timed, counted or locked */
+extern int stats_enabled;
+
+uint64_t stats_now(void);
+void stats_reset(void);
+void stats_record_time(enum StatsTimer timer, uint64_t start);
+void stats_record_count(enum StatsCounter counter, uint64_t n);
+void stats_record_latency(int slot, uint64_t start);
+
+/* Start time for STATS_TIME() and STATS_LATENCY(), 0 while disabled */
+#define STATS_START() \
+    (__builtin_expect(stats_enabled, 0) ? stats_now() : 0)
+
+#define STATS_TIME(timer, start) \
+    do { \
+        if (__builtin_expect(stats_enabled, 0)) \
+            stats_record_time(timer, start); \
+    } while (0)
+
+#define STATS_COUNT(counter, n) \
+    do { \
+        if (__builtin_expect(stats_enabled, 0)) \
+            stats_record_count(counter, n); \
+    } while (0)
+
+#define STATS_LATENCY(slot, start) \
+    do { \
+        if (__builtin_expect(stats_enabled, 0)) \
+            stats_record_latency(slot, start); \
+    } while (0)
+
+typedef const char *StatsNameFunc(int slot);
+void stats_print(FILE *f, StatsNameFunc *name);
+void stats_print_json(FILE *f, StatsNameFunc *name);
+int stats_save(const char *filename, StatsNameFunc *name);
+
+
+#endif
@@ -0,0 +1,131 @@
+/*
+ * Binary tracing of 78K0 UART traffic
+ *
+ * Copyright (c) 2011-2012 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU LGPL version 2.1 or (at your option) any later version.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "trace.h"
+#include "bswap.h"
+
+#ifndef CONFIG_NO_TRACE
+int trace_enabled;
+#endif
+
+static FILE *trace_file;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Flight recorder: only the most recent records are kept and written on close */
+static uint8_t *trace_ring;
+static size_t trace_ring_size;
+static size_t trace_ring_head;
+static size_t trace_ring_tail;
+
+static void ring_put(const void *data, size_t length)
+{
+    const uint8_t *p = data;
+    for (size_t i = 0; i < length; i++) {
+        trace_ring[trace_ring_head++ % trace_ring_size] = p[i];
+    }
+}
+
+static void ring_get(size_t pos, void *data, size_t length)
+{
+    uint8_t *p = data;
+    for (size_t i = 0; i < length; i++) {
+        p[i] = trace_ring[(pos + i) % trace_ring_size];
+    }
+}
+
+static void ring_record(const struct TraceRecord *rec, const void *data, size_t length)
+{
+    size_t needed = sizeof(*rec) + length;
+    if (needed > trace_ring_size)
+        return;
+    /* Drop the oldest records to make room */
+    while (trace_ring_size - (trace_ring_head - trace_ring_tail) < needed) {
+        struct TraceRecord old;
+        ring_get(trace_ring_tail, &old, sizeof(old));
+        trace_ring_tail += sizeof(old) + le16_to_cpu(old.length);
+    }
+    ring_put(rec, sizeof(*rec));
+    ring_put(data, length);
+}
+
+void trace_record(uint8_t kind, const void *data, size_t length)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    if (length > UINT16_MAX)
+        length = UINT16_MAX;
+    struct TraceRecord rec;
+    rec.timestamp_ns = cpu_to_le64(ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+    rec.length = cpu_to_le16(length);
+    rec.kind = kind;
+    rec.reserved = 0;
+
+    pthread_mutex_lock(&trace_mutex);
+    if (trace_ring != NULL) {
+        ring_record(&rec, data, length);
+    } else if (trace_file != NULL) {
+        fwrite(&rec, sizeof(rec), 1, trace_file);
+        fwrite(data, 1, length, trace_file);
+    }
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+int trace_open(const char *filename, size_t ring_size)
+{
+#ifdef CONFIG_NO_TRACE
+    fprintf(stderr, "Tracing not compiled in\n");
+    return -1;
+#else
+    trace_file = fopen(filename, "wb");
+    if (trace_file == NULL) {
+        perror(filename);
+        return -1;
+    }
+    fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), trace_file);
+    if (ring_size > 0) {
+        trace_ring = malloc(ring_size);
+        trace_ring_size = ring_size;
+        trace_ring_head = trace_ring_tail = 0;
+    }
+    trace_enabled = 1;
+    return 0;
+#endif
+}
+
+int trace_close(void)
+{
+    if (trace_file == NULL)
+        return 0;
+#ifndef CONFIG_NO_TRACE
+    trace_enabled = 0;
+#endif
+    pthread_mutex_lock(&trace_mutex);
+    if (trace_ring != NULL) {
+        uint8_t buf[256];
+        while (trace_ring_tail != trace_ring_head) {
+            size_t n = trace_ring_head - trace_ring_tail;
+            if (n > sizeof(buf))
+                n = sizeof(buf);
+            ring_get(trace_ring_tail, buf, n);
+            fwrite(buf, 1, n, trace_file);
+            trace_ring_tail += n;
+        }
+        free(trace_ring);
+        trace_ring = NULL;
+    }
+    int ret = fclose(trace_file);
+    trace_file = NULL;
+    pthread_mutex_unlock(&trace_mutex);
+    return ret;
+}
@@ -0,0 +1,50 @@
+/*
+ * Binary tracing of 78K0 UART traffic
+ *
+ * Copyright (c) 2011-2012 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU LGPL version 2.1 or (at your option) any later version.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define TRACE_MAGIC "78K0TRC1"
+
+enum TraceKind {
+    TRACE_CONTROL   = 0x00,     /* 78K0 control request */
+    TRACE_TX        = 0x01,     /* bytes written to the UART */
+    TRACE_RX        = 0x02,     /* bytes read from the UART */
+    TRACE_WAIT      = 0x03,     /* protocol wait, 32-bit microseconds */
+};
+
+/* Record header in a capture file, little endian, followed by the data */
+struct TraceRecord {
+    uint64_t timestamp_ns;
+    uint16_t length;
+    uint8_t kind;
+    uint8_t reserved;
+} __attribute__((packed));
+
+int trace_open(const char *filename, size_t ring_size);
+int trace_close(void);
+void trace_record(uint8_t kind, const void *data, size_t length);
+
+#ifdef CONFIG_NO_TRACE
+#define trace_enabled 0
+#else
+extern int trace_enabled;
+#endif
+
+#define TRACE(kind, data, length) \
+    do { \
+        if (__builtin_expect(trace_enabled, 0)) \
+            trace_record(kind, data, length); \
+    } while (0)
+
+
+#endif
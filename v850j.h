@@ -25,7 +25,10 @@
 #define V850J_H
 
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 #include "78k0_usb_uart.h"
 
@@ -72,14 +75,184 @@ enum V850ESJx3LStatus {
     V850ESJx3L_STATUS_BUSY              = 0xff,
 };
 
+#define V850ESJx3L_BLOCK_SIZE 4096
+/* Commands address 24 bits; RAM and peripherals lie beyond */
+#define V850ESJx3L_ADDRESS_LIMIT 0x1000000
+
+#define V850J_TIMEOUT_MS (3000 + 1000)
+#define V850J_CHIP_ERASE_TIMEOUT_MS (20000 + 1000)
+/* Added per block for commands working on a range, the chip erase's share */
+#define V850J_BLOCK_TIMEOUT_MS (20000 / 128)
+
+#define V850J_DATA_FRAME_SIZE 256
+#define V850J_FRAME_BUFFER_SIZE (2 + V850J_DATA_FRAME_SIZE + 2)
+
+/* STATUS polling backoff while an erase is in progress */
+#define V850J_POLL_INITIAL_US 1000
+#define V850J_POLL_MAX_US 8000
+
+struct V850Frame {
+    uint8_t type;       /* SOH or STX */
+    uint8_t end;        /* ETB or ETX */
+    uint8_t sum;
+    size_t length;
+    /* Payload, in buffer or in the parser's sink */
+    uint8_t *data;
+    uint8_t buffer[256];
+};
+
+enum V850FrameParseErrors {
+    V850J_FRAME_ERROR_START     = -1,
+    V850J_FRAME_ERROR_END       = -2,
+    V850J_FRAME_ERROR_CHECKSUM  = -3,
+};
+
+struct V850FrameParser {
+    int state;
+    size_t received;
+    uint8_t sum;
+    struct V850Frame frame;
+    /* If set, data frame payloads up to sink_size bytes are stored here */
+    uint8_t *sink;
+    size_t sink_size;
+};
+
+/* Data frames encoded ahead of time, one per 256 bytes of a buffer */
+struct V850DataFrames {
+    uint8_t (*frames)[V850J_FRAME_BUFFER_SIZE];
+    size_t *lengths;
+    size_t count;
+};
+
+/* Header and trailer of a frame whose payload is sent from where it is */
+struct V850FrameIov {
+    uint8_t header[3];
+    uint8_t trailer[2];
+    struct iovec iov[3];
+};
+
+void v850j_frame_parser_reset(struct V850FrameParser *parser);
+int v850j_frame_parse(struct V850FrameParser *parser, const uint8_t *data, size_t length,
+                      size_t *consumed, const struct V850Frame **frame);
+size_t v850j_command_frame_encode(uint8_t *buf, uint8_t command, const uint8_t *data, uint8_t length);
+size_t v850j_data_frame_encode(uint8_t *buf, const uint8_t *data, size_t length, bool last);
+/* Encode frame index of data, ending in ETX if it is the last one */
+void v850j_data_frames_encode(struct V850DataFrames *df, size_t index,
+                              const uint8_t *data, size_t length);
+/* Like the encoders above, but fill iov with header, data and trailer */
+size_t v850j_command_frame_iov(struct V850FrameIov *frame, uint8_t command, const uint8_t *data,
+                               uint8_t length);
+size_t v850j_data_frame_iov(struct V850FrameIov *frame, const uint8_t *data, size_t length, bool last);
+void v850j_address_encode(uint8_t *buf, uint32_t address);
+const char *v850j_command_name(uint8_t command);
+const char *v850j_status_name(uint8_t status);
+
+/* Protocol waits in microseconds */
+struct V850Timings {
+    uint32_t t12;
+    uint32_t t2C;
+    uint32_t tCOM;
+    uint32_t tWT10;
+};
+
+/* Silicon signature as returned by the bootloader */
+struct V850Signature {
+    uint8_t vendor;
+    uint8_t id[4];
+    uint32_t flash_end;
+    char name[11];
+    uint8_t security;
+    uint8_t boot;
+};
+
+struct V850Geometry {
+    const char *name;   /* NULL if not in the parts table */
+    uint32_t flash_size;
+    uint32_t block_size;
+    uint32_t blocks;
+};
+
+/* Erase durations measured on a board in microseconds, 0 until known */
+struct V850EraseCosts {
+    uint32_t block;     /* per block */
+    uint32_t chip;
+};
+
+/* Inclusive address range */
+struct V850Range {
+    uint32_t start;
+    uint32_t end;
+};
+
 struct V850Device {
     struct UART78K0 uart;
+    /* USB serial number or bus/address, keys per-board profiles */
+    char serial[64];
+    /* Oscillation frequency, 0 until set */
+    uint32_t fx;
+    /* Current UART rate of the bootloader */
+    uint32_t baud_rate;
+    struct V850Timings timings;
+    /* timings loaded or autotuned rather than derived from fx */
+    bool timings_tuned;
+    /* Received bytes not yet fed to the parser */
+    uint8_t rx_buffer[64];
+    size_t rx_pos;
+    size_t rx_length;
+    struct V850FrameParser parser;
+    /* Valid once the signature was queried or loaded */
+    bool signature_valid;
+    struct V850Signature signature;
+    struct V850Geometry geometry;
+    struct V850EraseCosts erase_costs;
+    /* Called with each range once the device has written and internally verified it */
+    void (*progress)(void *opaque, uint32_t address, size_t length);
+    void *progress_opaque;
+    /* Latency slot and send time of the frame awaiting a response, 0 if none */
+    int stats_slot;
+    uint64_t stats_start;
 };
 
 int v850j_reset(struct V850Device *handle);
 int v850j_get_silicon_signature(struct V850Device *handle);
+int v850j_signature_load(struct V850Device *handle, const char *filename);
+int v850j_signature_save(struct V850Device *handle, const char *filename);
+int v850j_erase_costs_load(struct V850Device *handle, const char *filename);
+int v850j_erase_costs_save(struct V850Device *handle, const char *filename);
 int v850j_osc_frequency_set(struct V850Device *handle, uint32_t frequency);
 int v850j_baud_rate_set(struct V850Device *handle, uint32_t baud_rate);
+int v850j_baud_rate_negotiate(struct V850Device *handle, uint32_t max_baud_rate, uint32_t *baud_rate);
+int v850j_reenter(struct V850Device *handle, uint32_t frequency);
+int v850j_connect(struct V850Device *handle, uint32_t frequency, uint32_t baud_rate);
+int v850j_resume(struct V850Device *handle);
+int v850j_session_load(struct V850Device *handle, const char *filename);
+int v850j_session_save(struct V850Device *handle, const char *filename);
+int v850j_chip_erase(struct V850Device *handle);
+int v850j_block_erase(struct V850Device *handle, uint32_t start, uint32_t end);
+int v850j_blank_check(struct V850Device *handle, uint32_t start, uint32_t end, bool *blank);
+int v850j_erase_planned(struct V850Device *handle, const struct V850Range *ranges, size_t num_ranges,
+                        size_t block_size, bool allow_chip_erase);
+int v850j_checksum(struct V850Device *handle, uint32_t start, uint32_t end, uint16_t *sum);
+int v850j_read(struct V850Device *handle, uint32_t start, uint32_t end, uint8_t *out);
+int v850j_program(struct V850Device *handle, uint32_t start, const uint8_t *data, size_t length);
+/* Program from frames first onwards of df, as encoded from the data at start */
+int v850j_program_frames(struct V850Device *handle, uint32_t start, size_t length,
+                         const struct V850DataFrames *df, size_t first);
+/* block_sums may hold the blocks' expected checksums, else they are computed */
+int v850j_program_verify(struct V850Device *handle, uint32_t start, const uint8_t *data, size_t length,
+                         size_t block_size, const uint16_t *block_sums);
+int v850j_program_delta(struct V850Device *handle, uint32_t start, const uint8_t *data, size_t length,
+                        size_t block_size, const uint16_t *block_sums);
+
+void v850j_default_timings(struct V850Device *handle, struct V850Timings *timings);
+const struct V850Timings *v850j_timings(struct V850Device *handle);
+/* Limit for a command whose duration grows with the blocks in start-end */
+int v850j_range_timeout_ms(struct V850Device *handle, uint32_t start, uint32_t end);
+int v850j_autotune(struct V850Device *handle, uint32_t frequency, uint32_t baud_rate);
+int v850j_timings_load(struct V850Device *handle, const char *filename);
+int v850j_timings_save(struct V850Device *handle, const char *filename);
+
+const char *v850j_stats_name(int slot);
 
 
 #endif
@@ -0,0 +1,770 @@
+/*
+ * Event-driven V850ES/Jx3-L flash commands
+ *
+ * Copyright (c) 2011-2012 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU LGPL version 2.1 or (at your option) any later version.
+ */
+#ifdef __linux__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <libusb-1.0/libusb.h>
+#include "v850j.h"
+#include "v850j_async.h"
+#include "78k0_usb_uart.h"
+#include "bswap.h"
+#include "trace.h"
+#include "stats.h"
+
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define V850J_ASYNC_PACKET_SIZE 64
+#define V850J_ASYNC_MAX_EVENTS 32
+
+/* Called when the descriptor it was registered with polls ready */
+struct V850Watch {
+    void (*fn)(struct V850Watch *watch, uint32_t events);
+};
+
+struct V850Timer {
+    uint64_t deadline;
+    bool armed;
+    struct V850Timer *next;
+    void (*fn)(struct V850Timer *timer);
+};
+
+struct V850Loop {
+    int epoll_fd;
+    /* Expires along with the earliest armed timer */
+    int timer_fd;
+    struct V850Watch timer_watch;
+    /* Armed timers, earliest first */
+    struct V850Timer *timers;
+    libusb_context *usb_context;
+    struct V850Watch usb_watch;
+    /* Commands in progress */
+    int pending;
+};
+
+enum V850AsyncPhase {
+    ASYNC_IDLE,
+    /* Waiting out tCOM or a polling interval before sending */
+    ASYNC_DELAY,
+    ASYNC_WRITE,
+    ASYNC_RESPONSE,
+};
+
+/* Handles the response frame to what was sent last */
+typedef void V850AsyncStep(struct V850Async *async, const struct V850Frame *frame);
+
+struct V850Async {
+    struct V850Loop *loop;
+    struct V850Device *dev;
+    struct V850Timer timer;
+    enum V850AsyncPhase phase;
+
+    /* Backend descriptor and the events watched on it, or -1 for libusb */
+    int fd;
+    uint32_t events;
+    struct V850Watch watch;
+    struct libusb_transfer *out_transfer;
+    struct libusb_transfer *in_transfer;
+    bool in_flight;
+    bool closing;
+    uint8_t rx[V850J_ASYNC_PACKET_SIZE];
+
+    /* Frame to send and what to do with the response */
+    uint8_t tx[V850J_FRAME_BUFFER_SIZE];
+    size_t tx_length;
+    size_t tx_done;
+    int tx_slot;
+    int timeout_ms;
+    V850AsyncStep *step;
+
+    /* Command in progress */
+    uint8_t command;
+    V850AsyncCallback *cb;
+    void *opaque;
+    uint32_t start;
+    const uint8_t *data;
+    size_t length;
+    size_t offset;
+    size_t chunk;
+    uint16_t *sum;
+    uint32_t poll_delay;
+    uint64_t poll_deadline;
+};
+
+static void loop_timer_update(struct V850Loop *loop)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (loop->timers != NULL) {
+        uint64_t t = loop->timers->deadline;
+        its.it_value.tv_sec = t / 1000000000ULL;
+        /* All zero would disarm */
+        its.it_value.tv_nsec = (t != 0) ? t % 1000000000ULL : 1;
+    }
+    timerfd_settime(loop->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void loop_timer_cancel(struct V850Loop *loop, struct V850Timer *timer)
+{
+    if (!timer->armed)
+        return;
+    struct V850Timer **p = &loop->timers;
+    while (*p != timer)
+        p = &(*p)->next;
+    *p = timer->next;
+    timer->armed = false;
+    if (p == &loop->timers)
+        loop_timer_update(loop);
+}
+
+static void loop_timer_arm(struct V850Loop *loop, struct V850Timer *timer, uint64_t deadline)
+{
+    loop_timer_cancel(loop, timer);
+    timer->deadline = deadline;
+    struct V850Timer **p = &loop->timers;
+    while (*p != NULL && (*p)->deadline <= deadline)
+        p = &(*p)->next;
+    timer->next = *p;
+    *p = timer;
+    timer->armed = true;
+    if (loop->timers == timer)
+        loop_timer_update(loop);
+}
+
+static void loop_timers_run(struct V850Loop *loop)
+{
+    uint64_t now = stats_now();
+    bool fired = false;
+    while (loop->timers != NULL && loop->timers->deadline <= now) {
+        struct V850Timer *timer = loop->timers;
+        loop->timers = timer->next;
+        timer->armed = false;
+        fired = true;
+        timer->fn(timer);
+    }
+    if (fired)
+        loop_timer_update(loop);
+}
+
+static void loop_timer_event(struct V850Watch *watch, uint32_t events)
+{
+    struct V850Loop *loop = container_of(watch, struct V850Loop, timer_watch);
+    uint64_t expirations;
+    /* Only clears readiness, due timers run after all events */
+    if (read(loop->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        fprintf(stderr, "%s: reading timer failed: %s\n", __func__, strerror(errno));
+}
+
+static void loop_usb_event(struct V850Watch *watch, uint32_t events)
+{
+    struct V850Loop *loop = container_of(watch, struct V850Loop, usb_watch);
+    struct timeval zero = { 0, 0 };
+    int ret = libusb_handle_events_timeout(loop->usb_context, &zero);
+    if (ret != LIBUSB_SUCCESS)
+        fprintf(stderr, "%s: handling events failed: %d\n", __func__, ret);
+}
+
+static void loop_usb_added(int fd, short events, void *user_data)
+{
+    struct V850Loop *loop = user_data;
+    struct epoll_event ev = {
+        .events = ((events & POLLIN) ? EPOLLIN : 0) | ((events & POLLOUT) ? EPOLLOUT : 0),
+        .data.ptr = &loop->usb_watch,
+    };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+        fprintf(stderr, "%s: watching fd %d failed: %s\n", __func__, fd, strerror(errno));
+}
+
+static void loop_usb_removed(int fd, void *user_data)
+{
+    struct V850Loop *loop = user_data;
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+struct V850Loop *v850j_loop_new(libusb_context *usb_context)
+{
+    struct V850Loop *loop = calloc(1, sizeof(struct V850Loop));
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    loop->timer_watch.fn = loop_timer_event;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &loop->timer_watch };
+    if (loop->epoll_fd < 0 || loop->timer_fd < 0 ||
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->timer_fd, &ev) != 0) {
+        fprintf(stderr, "%s: setting up the loop failed: %s\n", __func__, strerror(errno));
+        if (loop->timer_fd >= 0)
+            close(loop->timer_fd);
+        if (loop->epoll_fd >= 0)
+            close(loop->epoll_fd);
+        free(loop);
+        return NULL;
+    }
+
+    if (usb_context != NULL) {
+        loop->usb_context = usb_context;
+        loop->usb_watch.fn = loop_usb_event;
+        const struct libusb_pollfd **pollfds = libusb_get_pollfds(usb_context);
+        for (int i = 0; pollfds != NULL && pollfds[i] != NULL; i++) {
+            loop_usb_added(pollfds[i]->fd, pollfds[i]->events, loop);
+        }
+        libusb_free_pollfds(pollfds);
+        libusb_set_pollfd_notifiers(usb_context, loop_usb_added, loop_usb_removed, loop);
+    }
+    return loop;
+}
+
+void v850j_loop_free(struct V850Loop *loop)
+{
+    if (loop->usb_context != NULL)
+        libusb_set_pollfd_notifiers(loop->usb_context, NULL, NULL, NULL);
+    close(loop->timer_fd);
+    close(loop->epoll_fd);
+    free(loop);
+}
+
+int v850j_loop_fd(struct V850Loop *loop)
+{
+    return loop->epoll_fd;
+}
+
+int v850j_loop_dispatch(struct V850Loop *loop, int timeout_ms)
+{
+    struct timeval tv;
+    if (loop->usb_context != NULL && libusb_get_next_timeout(loop->usb_context, &tv) == 1) {
+        int usb_ms = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+        if (timeout_ms < 0 || usb_ms < timeout_ms)
+            timeout_ms = usb_ms;
+    }
+
+    struct epoll_event events[V850J_ASYNC_MAX_EVENTS];
+    int n = epoll_wait(loop->epoll_fd, events, V850J_ASYNC_MAX_EVENTS, timeout_ms);
+    if (n < 0) {
+        if (errno == EINTR)
+            return 0;
+        fprintf(stderr, "%s: epoll_wait failed: %s\n", __func__, strerror(errno));
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        struct V850Watch *watch = events[i].data.ptr;
+        watch->fn(watch, events[i].events);
+    }
+    /* libusb's own transfer timeouts */
+    if (n == 0 && loop->usb_context != NULL)
+        loop_usb_event(&loop->usb_watch, 0);
+    loop_timers_run(loop);
+    return 0;
+}
+
+int v850j_loop_run(struct V850Loop *loop)
+{
+    while (loop->pending > 0) {
+        if (v850j_loop_dispatch(loop, -1) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static void async_finish(struct V850Async *async, int ret)
+{
+    loop_timer_cancel(async->loop, &async->timer);
+    if (ret != 0)
+        v850j_frame_parser_reset(&async->dev->parser);
+    async->phase = ASYNC_IDLE;
+    async->step = NULL;
+    async->loop->pending--;
+    V850AsyncCallback *cb = async->cb;
+    async->cb = NULL;
+    cb(async, ret, async->opaque);
+}
+
+static void async_watch_events(struct V850Async *async, uint32_t events)
+{
+    if (async->fd < 0 || async->events == 0 || async->events == events)
+        return;
+    struct epoll_event ev = { .events = events, .data.ptr = &async->watch };
+    if (epoll_ctl(async->loop->epoll_fd, EPOLL_CTL_MOD, async->fd, &ev) != 0) {
+        fprintf(stderr, "%s: epoll_ctl failed: %s\n", __func__, strerror(errno));
+        return;
+    }
+    async->events = events;
+}
+
+/* Wait for the response to what was just sent, frames may already be there */
+static void async_expect(struct V850Async *async, int timeout_ms, V850AsyncStep *step)
+{
+    async->phase = ASYNC_RESPONSE;
+    async->step = step;
+    loop_timer_arm(async->loop, &async->timer, stats_now() + timeout_ms * UINT64_C(1000000));
+}
+
+static void async_written(struct V850Async *async)
+{
+    async->phase = ASYNC_RESPONSE;
+    loop_timer_arm(async->loop, &async->timer, stats_now() + async->timeout_ms * UINT64_C(1000000));
+}
+
+static void async_out_done(struct libusb_transfer *transfer)
+{
+    struct V850Async *async = transfer->user_data;
+    TRACE(TRACE_TX, transfer->buffer, transfer->actual_length);
+    STATS_COUNT(STATS_BYTES_WRITTEN, transfer->actual_length);
+    if (async->phase != ASYNC_WRITE)
+        return;
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED ||
+        transfer->actual_length != transfer->length) {
+        fprintf(stderr, "%s: sending failed: %d\n", __func__, transfer->status);
+        async_finish(async, -1);
+        return;
+    }
+    async_written(async);
+}
+
+static void async_write(struct V850Async *async)
+{
+    struct V850Device *dev = async->dev;
+    async->phase = ASYNC_WRITE;
+    if (async->tx_done == 0) {
+        dev->stats_slot = async->tx_slot;
+        dev->stats_start = STATS_START();
+    }
+
+    if (async->fd < 0) {
+        usb_78k0_fill_bulk_transfer(&dev->uart, async->out_transfer, false, async->tx,
+                                    async->tx_length, async_out_done, async, V850J_TIMEOUT_MS);
+        int ret = libusb_submit_transfer(async->out_transfer);
+        if (ret != LIBUSB_SUCCESS) {
+            fprintf(stderr, "%s: submitting failed: %d\n", __func__, ret);
+            async_finish(async, -1);
+        }
+        return;
+    }
+
+    int transferred = 0;
+    int ret = usb_78k0_write(&dev->uart, async->tx + async->tx_done,
+                             async->tx_length - async->tx_done, &transferred, 0);
+    async->tx_done += transferred;
+    if (ret == LIBUSB_SUCCESS && async->tx_done == async->tx_length) {
+        async_watch_events(async, EPOLLIN);
+        async_written(async);
+    } else if (ret == LIBUSB_SUCCESS || ret == LIBUSB_ERROR_TIMEOUT) {
+        /* Go on once the descriptor takes more */
+        async_watch_events(async, EPOLLIN | EPOLLOUT);
+    } else {
+        fprintf(stderr, "%s: sending failed: %d\n", __func__, ret);
+        async_watch_events(async, EPOLLIN);
+        async_finish(async, -1);
+    }
+}
+
+/* Send the frame in tx after delay_us, the response goes to step */
+static void async_send(struct V850Async *async, size_t length, int slot, uint32_t delay_us,
+                       int timeout_ms, V850AsyncStep *step)
+{
+    async->tx_length = length;
+    async->tx_done = 0;
+    async->tx_slot = slot;
+    async->timeout_ms = timeout_ms;
+    async->step = step;
+    async->phase = ASYNC_DELAY;
+    uint32_t le_us = cpu_to_le32(delay_us);
+    TRACE(TRACE_WAIT, &le_us, sizeof(le_us));
+    loop_timer_arm(async->loop, &async->timer, stats_now() + delay_us * UINT64_C(1000));
+}
+
+static void async_send_command(struct V850Async *async, uint8_t command, const uint8_t *data,
+                               uint8_t length, uint32_t delay_us, int timeout_ms,
+                               V850AsyncStep *step)
+{
+    size_t frame_length = v850j_command_frame_encode(async->tx, command, data, length);
+    async_send(async, frame_length, command, delay_us, timeout_ms, step);
+}
+
+static void async_timer(struct V850Timer *timer)
+{
+    struct V850Async *async = container_of(timer, struct V850Async, timer);
+    switch (async->phase) {
+    case ASYNC_DELAY:
+        async_write(async);
+        break;
+    case ASYNC_RESPONSE:
+        fprintf(stderr, "%s: no response to %s\n", __func__, v850j_stats_name(async->tx_slot));
+        STATS_COUNT(STATS_TIMEOUTS, 1);
+        async_finish(async, -1);
+        break;
+    default:
+        break;
+    }
+}
+
+static void async_receive(struct V850Async *async, const uint8_t *data, size_t length)
+{
+    struct V850Device *dev = async->dev;
+    size_t pos = 0;
+    while (pos < length) {
+        size_t consumed;
+        const struct V850Frame *frame;
+        int ret = v850j_frame_parse(&dev->parser, data + pos, length - pos, &consumed, &frame);
+        pos += consumed;
+        if (ret == 0)
+            continue;
+        /* The response can beat the OUT completion to the event loop */
+        if (async->phase != ASYNC_RESPONSE && async->phase != ASYNC_WRITE) {
+            fprintf(stderr, "%s: unexpected frame: %d\n", __func__, ret);
+            continue;
+        }
+        if (ret < 0) {
+            fprintf(stderr, "%s: invalid frame: %d\n", __func__, ret);
+            async_finish(async, -1);
+            return;
+        }
+        if (frame->type != V850ESJx3L_STX) {
+            fprintf(stderr, "%s: no data frame: %02" PRIX8 "\n", __func__, frame->type);
+            async_finish(async, -1);
+            return;
+        }
+        if (dev->stats_start != 0) {
+            STATS_LATENCY(dev->stats_slot, dev->stats_start);
+            dev->stats_start = 0;
+        }
+        loop_timer_cancel(async->loop, &async->timer);
+        async->step(async, frame);
+    }
+}
+
+static void async_event(struct V850Watch *watch, uint32_t events)
+{
+    struct V850Async *async = container_of(watch, struct V850Async, watch);
+    if ((events & EPOLLOUT) && async->phase == ASYNC_WRITE)
+        async_write(async);
+    if (!(events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+        return;
+
+    int transferred = 0;
+    int ret = usb_78k0_read(&async->dev->uart, async->rx, sizeof(async->rx), &transferred, 0);
+    if (ret == LIBUSB_SUCCESS) {
+        async_receive(async, async->rx, transferred);
+    } else if (ret != LIBUSB_ERROR_TIMEOUT) {
+        fprintf(stderr, "%s: receiving failed: %d\n", __func__, ret);
+        /* Stop polling a dead descriptor */
+        epoll_ctl(async->loop->epoll_fd, EPOLL_CTL_DEL, async->fd, NULL);
+        async->events = 0;
+        if (async->phase != ASYNC_IDLE)
+            async_finish(async, -1);
+    }
+}
+
+static void async_in_done(struct libusb_transfer *transfer)
+{
+    struct V850Async *async = transfer->user_data;
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+        if (transfer->actual_length > 0) {
+            TRACE(TRACE_RX, transfer->buffer, transfer->actual_length);
+            STATS_COUNT(STATS_BYTES_READ, transfer->actual_length);
+        }
+        async_receive(async, transfer->buffer, transfer->actual_length);
+    } else if (transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+        fprintf(stderr, "%s: receiving failed: %d\n", __func__, transfer->status);
+    }
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED || async->closing) {
+        async->in_flight = false;
+    } else if (libusb_submit_transfer(transfer) != LIBUSB_SUCCESS) {
+        fprintf(stderr, "%s: resubmitting failed\n", __func__);
+        async->in_flight = false;
+    }
+    if (!async->in_flight && !async->closing && async->phase != ASYNC_IDLE)
+        async_finish(async, -1);
+}
+
+struct V850Async *v850j_async_new(struct V850Loop *loop, struct V850Device *dev)
+{
+    const struct UART78K0Backend *backend = dev->uart.backend;
+#ifdef UART_ASYNC_READ
+    if (backend == NULL) {
+        fprintf(stderr, "%s: the USB read thread owns the IN endpoint\n", __func__);
+        return NULL;
+    }
+#endif
+    if ((backend == NULL) ? (loop->usb_context == NULL) : (backend->fd == NULL)) {
+        fprintf(stderr, "%s: the device's transport cannot be polled\n", __func__);
+        return NULL;
+    }
+
+    struct V850Async *async = calloc(1, sizeof(struct V850Async));
+    async->loop = loop;
+    async->dev = dev;
+    async->timer.fn = async_timer;
+    async->fd = -1;
+    /* Leftovers from blocking commands belong to no command here */
+    dev->rx_pos = dev->rx_length;
+    v850j_frame_parser_reset(&dev->parser);
+
+    if (backend != NULL) {
+        async->fd = backend->fd(&dev->uart);
+        async->watch.fn = async_event;
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &async->watch };
+        if (async->fd < 0 || epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, async->fd, &ev) != 0) {
+            fprintf(stderr, "%s: watching the device failed: %s\n", __func__, strerror(errno));
+            free(async);
+            return NULL;
+        }
+        async->events = EPOLLIN;
+        return async;
+    }
+
+    /* One IN transfer stays submitted and feeds the parser as packets come in */
+    async->out_transfer = libusb_alloc_transfer(0);
+    async->in_transfer = libusb_alloc_transfer(0);
+    usb_78k0_fill_bulk_transfer(&dev->uart, async->in_transfer, true, async->rx, sizeof(async->rx),
+                                async_in_done, async, 0);
+    int ret = libusb_submit_transfer(async->in_transfer);
+    if (ret != LIBUSB_SUCCESS) {
+        fprintf(stderr, "%s: submitting failed: %d\n", __func__, ret);
+        libusb_free_transfer(async->in_transfer);
+        libusb_free_transfer(async->out_transfer);
+        free(async);
+        return NULL;
+    }
+    async->in_flight = true;
+    return async;
+}
+
+void v850j_async_free(struct V850Async *async)
+{
+    loop_timer_cancel(async->loop, &async->timer);
+    if (async->phase != ASYNC_IDLE)
+        async->loop->pending--;
+    async->closing = true;
+    if (async->fd >= 0) {
+        if (async->events != 0)
+            epoll_ctl(async->loop->epoll_fd, EPOLL_CTL_DEL, async->fd, NULL);
+    } else {
+        if (async->in_flight)
+            libusb_cancel_transfer(async->in_transfer);
+        while (async->in_flight) {
+            if (libusb_handle_events(async->loop->usb_context) != LIBUSB_SUCCESS)
+                break;
+        }
+        libusb_free_transfer(async->in_transfer);
+        libusb_free_transfer(async->out_transfer);
+    }
+    free(async);
+}
+
+static int async_begin(struct V850Async *async, uint8_t command, V850AsyncCallback *cb,
+                       void *opaque)
+{
+    if (async->phase != ASYNC_IDLE) {
+        fprintf(stderr, "%s: %s still in progress\n", __func__, v850j_command_name(async->command));
+        return -1;
+    }
+    async->command = command;
+    async->cb = cb;
+    async->opaque = opaque;
+    async->loop->pending++;
+    return 0;
+}
+
+static uint32_t async_tCOM(struct V850Async *async)
+{
+    return v850j_timings(async->dev)->tCOM;
+}
+
+static void erase_status(struct V850Async *async, const struct V850Frame *frame);
+
+/* Like the blocking wait_ready(), backing off between polls */
+static void erase_poll(struct V850Async *async)
+{
+    async_send_command(async, V850ESJx3L_STATUS, NULL, 0, async_tCOM(async) + async->poll_delay,
+                       V850J_TIMEOUT_MS, erase_status);
+}
+
+static void erase_status(struct V850Async *async, const struct V850Frame *frame)
+{
+    uint8_t st1 = frame->data[0];
+    uint8_t st2 = (frame->length >= 2) ? frame->data[1] : V850ESJx3L_STATUS_ACK;
+    if (st1 == V850ESJx3L_STATUS_BUSY) {
+        if (stats_now() >= async->poll_deadline) {
+            fprintf(stderr, "%s: still busy after %d ms\n", __func__,
+                    v850j_range_timeout_ms(async->dev, async->start, async->start + async->length - 1));
+            async_finish(async, -1);
+            return;
+        }
+        async->poll_delay = (async->poll_delay == 0) ? V850J_POLL_INITIAL_US :
+                            (async->poll_delay * 2 > V850J_POLL_MAX_US) ? V850J_POLL_MAX_US :
+                            async->poll_delay * 2;
+        erase_poll(async);
+        return;
+    }
+    if (st1 != V850ESJx3L_STATUS_ACK || st2 != V850ESJx3L_STATUS_ACK) {
+        fprintf(stderr, "%s: operation failed: %02" PRIX8 " %02" PRIX8 "\n", __func__, st1, st2);
+        async_finish(async, -1);
+        return;
+    }
+    async_finish(async, 0);
+}
+
+static void erase_ack(struct V850Async *async, const struct V850Frame *frame)
+{
+    if (frame->data[0] != V850ESJx3L_STATUS_ACK) {
+        fprintf(stderr, "%s: no ACK: %02" PRIX8 "\n", __func__, frame->data[0]);
+        async_finish(async, -1);
+        return;
+    }
+    async->poll_delay = 0;
+    int timeout_ms = v850j_range_timeout_ms(async->dev, async->start, async->start + async->length - 1);
+    async->poll_deadline = stats_now() + timeout_ms * UINT64_C(1000000);
+    erase_poll(async);
+}
+
+int v850j_async_block_erase(struct V850Async *async, uint32_t start, uint32_t end,
+                            V850AsyncCallback *cb, void *opaque)
+{
+    if (async_begin(async, V850ESJx3L_BLOCK_ERASE, cb, opaque) != 0)
+        return -1;
+    async->start = start;
+    async->length = end - start + 1;
+    uint8_t buf[6];
+    v850j_address_encode(&buf[0], start);
+    v850j_address_encode(&buf[3], end);
+    async_send_command(async, V850ESJx3L_BLOCK_ERASE, buf, 6, async_tCOM(async),
+                       v850j_range_timeout_ms(async->dev, start, end), erase_ack);
+    return 0;
+}
+
+static void checksum_data(struct V850Async *async, const struct V850Frame *frame)
+{
+    if (frame->length < 2) {
+        fprintf(stderr, "%s: short checksum frame (%zu)\n", __func__, frame->length);
+        async_finish(async, -1);
+        return;
+    }
+    *async->sum = (frame->data[0] << 8) | frame->data[1];
+    async_finish(async, 0);
+}
+
+static void checksum_ack(struct V850Async *async, const struct V850Frame *frame)
+{
+    if (frame->data[0] != V850ESJx3L_STATUS_ACK) {
+        fprintf(stderr, "%s: no ACK: %02" PRIX8 "\n", __func__, frame->data[0]);
+        async_finish(async, -1);
+        return;
+    }
+    async_expect(async, V850J_TIMEOUT_MS, checksum_data);
+}
+
+int v850j_async_checksum(struct V850Async *async, uint32_t start, uint32_t end, uint16_t *sum,
+                         V850AsyncCallback *cb, void *opaque)
+{
+    if ((start & 0xff) != 0x00 || (end & 0xff) != 0xff || end < start) {
+        fprintf(stderr, "%s: invalid range 0x%06" PRIX32 "-0x%06" PRIX32 "\n", __func__, start, end);
+        return -1;
+    }
+    if (async_begin(async, V850ESJx3L_CHECKSUM, cb, opaque) != 0)
+        return -1;
+    async->sum = sum;
+    uint8_t buf[6];
+    v850j_address_encode(&buf[0], start);
+    v850j_address_encode(&buf[3], end);
+    async_send_command(async, V850ESJx3L_CHECKSUM, buf, 6, async_tCOM(async),
+                       V850J_TIMEOUT_MS, checksum_ack);
+    return 0;
+}
+
+static void program_status(struct V850Async *async, const struct V850Frame *frame);
+
+/* The next frame is encoded while tCOM runs down */
+static void program_send(struct V850Async *async)
+{
+    size_t remaining = async->length - async->offset;
+    async->chunk = (remaining > V850J_DATA_FRAME_SIZE) ? V850J_DATA_FRAME_SIZE : remaining;
+    size_t frame_length = v850j_data_frame_encode(async->tx, async->data + async->offset,
+                                                  async->chunk, async->chunk == remaining);
+    async_send(async, frame_length, STATS_DATA_FRAME, async_tCOM(async), V850J_TIMEOUT_MS,
+               program_status);
+}
+
+static void program_verify(struct V850Async *async, const struct V850Frame *frame)
+{
+    if (frame->data[0] != V850ESJx3L_STATUS_ACK) {
+        fprintf(stderr, "%s: internal verify failed: %02" PRIX8 "\n", __func__, frame->data[0]);
+        async_finish(async, -1);
+        return;
+    }
+    struct V850Device *dev = async->dev;
+    if (dev->progress != NULL)
+        dev->progress(dev->progress_opaque, async->start, async->length);
+    async_finish(async, 0);
+}
+
+static void program_status(struct V850Async *async, const struct V850Frame *frame)
+{
+    uint32_t address = async->start + async->offset;
+    if (frame->length < 2 || frame->data[0] != V850ESJx3L_STATUS_ACK) {
+        fprintf(stderr, "%s: data frame at 0x%06" PRIX32 " not received: %02" PRIX8 "\n",
+                __func__, address, frame->data[0]);
+        async_finish(async, -1);
+        return;
+    }
+    if (frame->data[1] != V850ESJx3L_STATUS_ACK) {
+        fprintf(stderr, "%s: writing 0x%06" PRIX32 " failed: %02" PRIX8 "\n",
+                __func__, address, frame->data[1]);
+        async_finish(async, -1);
+        return;
+    }
+    async->offset += async->chunk;
+    if (async->offset == async->length) {
+        /* Internal verify after the last data frame */
+        async_expect(async, v850j_range_timeout_ms(async->dev, async->start,
+                                                   async->start + async->length - 1),
+                     program_verify);
+        return;
+    }
+    program_send(async);
+}
+
+static void program_ack(struct V850Async *async, const struct V850Frame *frame)
+{
+    if (frame->data[0] != V850ESJx3L_STATUS_ACK) {
+        fprintf(stderr, "%s: no ACK: %02" PRIX8 "\n", __func__, frame->data[0]);
+        async_finish(async, -1);
+        return;
+    }
+    program_send(async);
+}
+
+int v850j_async_program(struct V850Async *async, uint32_t start, const uint8_t *data, size_t length,
+                        V850AsyncCallback *cb, void *opaque)
+{
+    if (length == 0 || (start & 0x3) != 0 || (length & 0x3) != 0 ||
+        start + length - 1 > 0xffffff) {
+        fprintf(stderr, "%s: invalid range 0x%06" PRIX32 " (%zu bytes)\n", __func__, start, length);
+        return -1;
+    }
+    if (async_begin(async, V850ESJx3L_PROGRAMMING, cb, opaque) != 0)
+        return -1;
+    async->start = start;
+    async->data = data;
+    async->length = length;
+    async->offset = 0;
+    uint8_t buf[6];
+    v850j_address_encode(&buf[0], start);
+    v850j_address_encode(&buf[3], start + length - 1);
+    async_send_command(async, V850ESJx3L_PROGRAMMING, buf, 6, async_tCOM(async),
+                       V850J_TIMEOUT_MS, program_ack);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,56 @@
+/*
+ * Event-driven V850ES/Jx3-L flash commands
+ *
+ * Copyright (c) 2011-2012 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU LGPL version 2.1 or (at your option) any later version.
+ */
+#ifndef V850J_ASYNC_H
+#define V850J_ASYNC_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "v850j.h"
+
+
+#ifdef __linux__
+struct V850Loop;
+struct V850Async;
+
+/* ret is 0 on success and -1 on failure */
+typedef void V850AsyncCallback(struct V850Async *async, int ret, void *opaque);
+
+/*
+ * One loop drives any number of devices from a single thread. usb_context
+ * may be NULL if all devices use a backend with a descriptor.
+ */
+struct V850Loop *v850j_loop_new(libusb_context *usb_context);
+void v850j_loop_free(struct V850Loop *loop);
+/* Polls readable while the loop has work, to nest it into another epoll set */
+int v850j_loop_fd(struct V850Loop *loop);
+/* Wait up to timeout_ms (-1 for no limit) for I/O and timers and run completions */
+int v850j_loop_dispatch(struct V850Loop *loop, int timeout_ms);
+/* Dispatch until no command is in progress */
+int v850j_loop_run(struct V850Loop *loop);
+
+/*
+ * Take over the link of a device that is through its handshake. Only one
+ * command per device is in progress at a time; its callback may submit
+ * the next one but must not free async.
+ */
+struct V850Async *v850j_async_new(struct V850Loop *loop, struct V850Device *dev);
+void v850j_async_free(struct V850Async *async);
+
+/* These return -1 without calling cb if the command could not be started */
+int v850j_async_block_erase(struct V850Async *async, uint32_t start, uint32_t end,
+                            V850AsyncCallback *cb, void *opaque);
+int v850j_async_checksum(struct V850Async *async, uint32_t start, uint32_t end, uint16_t *sum,
+                         V850AsyncCallback *cb, void *opaque);
+int v850j_async_program(struct V850Async *async, uint32_t start, const uint8_t *data, size_t length,
+                        V850AsyncCallback *cb, void *opaque);
+#endif
+
+
+#endif
@@ -0,0 +1,179 @@
+/*
+ * Incremental frame parser for the Renesas V850ES/Jx3-L flash protocol
+ *
+ * Copyright (c) 2011-2012 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU LGPL version 2.1 or (at your option) any later version.
+ */
+
+#include <string.h>
+#include <libusb-1.0/libusb.h>
+#include "v850j.h"
+#include "checksum.h"
+
+enum V850FrameParserState {
+    V850J_FRAME_START = 0,
+    V850J_FRAME_LENGTH,
+    V850J_FRAME_DATA,
+    V850J_FRAME_CHECKSUM,
+    V850J_FRAME_END,
+};
+
+void v850j_frame_parser_reset(struct V850FrameParser *parser)
+{
+    parser->state = V850J_FRAME_START;
+}
+
+int v850j_frame_parse(struct V850FrameParser *parser, const uint8_t *data, size_t length,
+                      size_t *consumed, const struct V850Frame **frame)
+{
+    struct V850Frame *f = &parser->frame;
+    size_t i = 0;
+    while (i < length) {
+        if (parser->state == V850J_FRAME_DATA) {
+            /* Take as much payload as is available in one go */
+            size_t n = f->length - parser->received;
+            if (n > length - i)
+                n = length - i;
+            memcpy(f->data + parser->received, data + i, n);
+            parser->sum -= checksum_sum(data + i, n);
+            parser->received += n;
+            i += n;
+            if (parser->received == f->length)
+                parser->state = V850J_FRAME_CHECKSUM;
+            continue;
+        }
+
+        uint8_t b = data[i++];
+        switch (parser->state) {
+        case V850J_FRAME_START:
+            if (b != V850ESJx3L_SOH && b != V850ESJx3L_STX) {
+                *consumed = i;
+                return V850J_FRAME_ERROR_START;
+            }
+            f->type = b;
+            parser->state = V850J_FRAME_LENGTH;
+            break;
+        case V850J_FRAME_LENGTH:
+            f->length = (b == 0) ? 256 : b;
+            f->data = (f->type == V850ESJx3L_STX && parser->sink != NULL &&
+                       f->length <= parser->sink_size) ? parser->sink : f->buffer;
+            parser->received = 0;
+            parser->sum = -b;
+            parser->state = V850J_FRAME_DATA;
+            break;
+        case V850J_FRAME_CHECKSUM:
+            f->sum = b;
+            parser->state = V850J_FRAME_END;
+            break;
+        case V850J_FRAME_END:
+            parser->state = V850J_FRAME_START;
+            *consumed = i;
+            if (b != V850ESJx3L_ETX && b != V850ESJx3L_ETB)
+                return V850J_FRAME_ERROR_END;
+            if (f->sum != parser->sum)
+                return V850J_FRAME_ERROR_CHECKSUM;
+            f->end = b;
+            *frame = f;
+            return 1;
+        }
+    }
+    *consumed = i;
+    return 0;
+}
+
+size_t v850j_command_frame_encode(uint8_t *buf, uint8_t command, const uint8_t *data, uint8_t length)
+{
+    buf[0] = V850ESJx3L_SOH;
+    buf[1] = (length == 255) ? 0 : (length + 1);
+    buf[2] = command;
+    if (length > 0)
+        memcpy(&buf[3], data, length);
+    buf[3 + length] = -checksum_sum(&buf[1], length + 2);
+    buf[3 + length + 1] = V850ESJx3L_ETX;
+    return length + 5;
+}
+
+size_t v850j_data_frame_encode(uint8_t *buf, const uint8_t *data, size_t length, bool last)
+{
+    buf[0] = V850ESJx3L_STX;
+    buf[1] = (length == V850J_DATA_FRAME_SIZE) ? 0 : length;
+    memcpy(&buf[2], data, length);
+    buf[2 + length] = -checksum_sum(&buf[1], length + 1);
+    buf[2 + length + 1] = last ? V850ESJx3L_ETX : V850ESJx3L_ETB;
+    return length + 4;
+}
+
+size_t v850j_command_frame_iov(struct V850FrameIov *frame, uint8_t command, const uint8_t *data,
+                               uint8_t length)
+{
+    frame->header[0] = V850ESJx3L_SOH;
+    frame->header[1] = (length == 255) ? 0 : (length + 1);
+    frame->header[2] = command;
+    uint32_t sum = frame->header[1] + command + ((length > 0) ? checksum_sum(data, length) : 0);
+    frame->trailer[0] = -sum;
+    frame->trailer[1] = V850ESJx3L_ETX;
+    frame->iov[0] = (struct iovec){ frame->header, 3 };
+    frame->iov[1] = (struct iovec){ (void *)data, length };
+    frame->iov[2] = (struct iovec){ frame->trailer, 2 };
+    return length + 5;
+}
+
+size_t v850j_data_frame_iov(struct V850FrameIov *frame, const uint8_t *data, size_t length, bool last)
+{
+    frame->header[0] = V850ESJx3L_STX;
+    frame->header[1] = (length == V850J_DATA_FRAME_SIZE) ? 0 : length;
+    frame->trailer[0] = -(frame->header[1] + checksum_sum(data, length));
+    frame->trailer[1] = last ? V850ESJx3L_ETX : V850ESJx3L_ETB;
+    frame->iov[0] = (struct iovec){ frame->header, 2 };
+    frame->iov[1] = (struct iovec){ (void *)data, length };
+    frame->iov[2] = (struct iovec){ frame->trailer, 2 };
+    return length + 4;
+}
+
+void v850j_address_encode(uint8_t *buf, uint32_t address)
+{
+    buf[0] = (address >> 16) & 0xff;
+    buf[1] = (address >> 8) & 0xff;
+    buf[2] = address & 0xff;
+}
+
+const char *v850j_command_name(uint8_t command)
+{
+    switch (command) {
+    case V850ESJx3L_RESET:              return "RESET";
+    case V850ESJx3L_VERIFY:             return "VERIFY";
+    case V850ESJx3L_CHIP_ERASE:         return "CHIP_ERASE";
+    case V850ESJx3L_BLOCK_ERASE:        return "BLOCK_ERASE";
+    case V850ESJx3L_BLOCK_BLANK_CHECK:  return "BLOCK_BLANK_CHECK";
+    case V850ESJx3L_PROGRAMMING:        return "PROGRAMMING";
+    case V850ESJx3L_READ:               return "READ";
+    case V850ESJx3L_STATUS:             return "STATUS";
+    case V850ESJx3L_OSC_FREQUENCY_SET:  return "OSC_FREQUENCY_SET";
+    case V850ESJx3L_BAUD_RATE_SET:      return "BAUD_RATE_SET";
+    case V850ESJx3L_SECURITY_GET:       return "SECURITY_GET";
+    case V850ESJx3L_CHECKSUM:           return "CHECKSUM";
+    case V850ESJx3L_SILICON_SIGNATURE:  return "SILICON_SIGNATURE";
+    case V850ESJx3L_VERSION_GET:        return "VERSION_GET";
+    default:                            return NULL;
+    }
+}
+
+const char *v850j_status_name(uint8_t status)
+{
+    switch (status) {
+    case V850ESJx3L_STATUS_COMMAND_ERROR:   return "COMMAND_ERROR";
+    case V850ESJx3L_STATUS_PARAM_ERROR:     return "PARAM_ERROR";
+    case V850ESJx3L_STATUS_ACK:             return "ACK";
+    case V850ESJx3L_STATUS_CHECKSUM_ERROR:  return "CHECKSUM_ERROR";
+    case V850ESJx3L_STATUS_VERIFY_ERROR:    return "VERIFY_ERROR";
+    case V850ESJx3L_STATUS_PROTECT_ERROR:   return "PROTECT_ERROR";
+    case V850ESJx3L_STATUS_NACK:            return "NACK";
+    case V850ESJx3L_STATUS_MRG10_ERROR:     return "MRG10_ERROR";
+    case V850ESJx3L_STATUS_MRG11_ERROR:     return "MRG11_ERROR";
+    case V850ESJx3L_STATUS_WRITE_ERROR:     return "WRITE_ERROR";
+    case V850ESJx3L_STATUS_READ_ERROR:      return "READ_ERROR";
+    case V850ESJx3L_STATUS_BUSY:            return "BUSY";
+    default:                                return NULL;
+    }
+}
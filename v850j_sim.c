@@ -0,0 +1,569 @@
+/*
+ * Simulated Renesas V850ES/Jx3-L flash bootloader
+ *
+ * Copyright (c) 2011-2012 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU LGPL version 2.1 or (at your option) any later version.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
+#include <libusb-1.0/libusb.h>
+#include "v850j.h"
+#include "v850j_sim.h"
+#include "78k0_usb_uart.h"
+
+/* Time the 78K0 gathers received bytes before sending a USB packet */
+#define SIM_USB_FRAME_NS        1000000ULL
+#define SIM_BLOCK_ERASE_NS      (10 * 1000000ULL)
+#define SIM_CHIP_ERASE_NS       (40 * 1000000ULL)
+#define SIM_BLANK_CHECK_NS      (500 * 1000ULL)
+#define SIM_PROGRAM_NS_PER_256  (1 * 1000000ULL)
+
+#define SIM_OUT_SIZE 4096
+
+enum V850SimMode {
+    SIM_IDLE,
+    SIM_PROGRAM,
+    SIM_VERIFY,
+    SIM_READ,
+};
+
+struct V850Sim {
+    char device_name[11];
+    uint8_t *flash;
+    size_t flash_size;
+    uint32_t max_baud_rate;
+
+    /* UART line state */
+    uint32_t host_baud_rate;
+    uint32_t device_baud_rate;
+    bool rts;
+    uint64_t rx_free_at;
+    uint64_t tx_free_at;
+
+    /* Bootloader state */
+    bool running;
+    bool flash_mode;
+    int sync_count;
+    struct V850FrameParser parser;
+    uint64_t busy_until;
+    uint8_t status[2];
+    enum V850SimMode mode;
+    uint32_t address;
+    uint32_t end;
+
+    /* Bytes on their way to the host, with arrival time and line rate */
+    uint8_t out[SIM_OUT_SIZE];
+    uint64_t out_ready[SIM_OUT_SIZE];
+    uint32_t out_baud_rate[SIM_OUT_SIZE];
+    size_t out_head;
+    size_t out_tail;
+    /* Readable while a packet for the host is ready, -1 until asked for */
+    int timer_fd;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t t)
+{
+    struct timespec ts;
+    ts.tv_sec = t / 1000000000ULL;
+    ts.tv_nsec = t % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+    }
+}
+
+/* 8N1: start bit, 8 data bits, stop bit */
+static uint64_t byte_ns(uint32_t baud_rate)
+{
+    return 10 * 1000000000ULL / baud_rate;
+}
+
+static uint64_t max_u64(uint64_t a, uint64_t b)
+{
+    return (a > b) ? a : b;
+}
+
+static bool sim_link_ok(struct V850Sim *sim)
+{
+    return sim->running && sim->device_baud_rate <= sim->max_baud_rate;
+}
+
+static void sim_emit(struct V850Sim *sim, uint64_t t, const uint8_t *data, size_t length)
+{
+    if (!sim_link_ok(sim))
+        return;
+    uint64_t ready = max_u64(t, sim->tx_free_at);
+    for (size_t i = 0; i < length; i++) {
+        if (sim->out_head - sim->out_tail == SIM_OUT_SIZE) {
+            fprintf(stderr, "%s: output overflow\n", __func__);
+            return;
+        }
+        ready += byte_ns(sim->device_baud_rate);
+        size_t index = sim->out_head++ % SIM_OUT_SIZE;
+        sim->out[index] = data[i];
+        sim->out_ready[index] = ready;
+        sim->out_baud_rate[index] = sim->device_baud_rate;
+    }
+    sim->tx_free_at = ready;
+}
+
+static void sim_send_frame(struct V850Sim *sim, uint64_t t, const uint8_t *data, size_t length,
+                           uint8_t end)
+{
+    uint8_t buf[2 + 256 + 2];
+    uint8_t sum = 0x00;
+    buf[0] = V850ESJx3L_STX;
+    buf[1] = length & 0xff;
+    sum -= buf[1];
+    for (size_t i = 0; i < length; i++) {
+        buf[2 + i] = data[i];
+        sum -= data[i];
+    }
+    buf[2 + length] = sum;
+    buf[3 + length] = end;
+    sim_emit(sim, t, buf, length + 4);
+}
+
+static void sim_send_status(struct V850Sim *sim, uint64_t t, uint8_t st1)
+{
+    sim->status[0] = st1;
+    sim->status[1] = V850ESJx3L_STATUS_ACK;
+    sim_send_frame(sim, max_u64(t, sim->busy_until), sim->status, 1, V850ESJx3L_ETX);
+}
+
+static void sim_send_status2(struct V850Sim *sim, uint64_t t, uint8_t st1, uint8_t st2)
+{
+    sim->status[0] = st1;
+    sim->status[1] = st2;
+    sim_send_frame(sim, max_u64(t, sim->busy_until), sim->status, 2, V850ESJx3L_ETX);
+}
+
+/* Acknowledge a command right away, STATUS reports when it has finished */
+static void sim_accept(struct V850Sim *sim, uint64_t t)
+{
+    uint8_t ack = V850ESJx3L_STATUS_ACK;
+    sim->status[0] = V850ESJx3L_STATUS_ACK;
+    sim->status[1] = V850ESJx3L_STATUS_ACK;
+    sim_send_frame(sim, t, &ack, 1, V850ESJx3L_ETX);
+}
+
+static void sim_busy(struct V850Sim *sim, uint64_t t, uint64_t duration)
+{
+    sim->busy_until = max_u64(t, sim->busy_until) + duration;
+}
+
+static bool sim_decode_range(struct V850Sim *sim, const uint8_t *param, size_t param_length,
+                             uint32_t *start, uint32_t *end)
+{
+    if (param_length < 6)
+        return false;
+    *start = (param[0] << 16) | (param[1] << 8) | param[2];
+    *end = (param[3] << 16) | (param[4] << 8) | param[5];
+    return *start <= *end && *end < sim->flash_size;
+}
+
+static uint32_t sim_baud_rate(uint8_t code)
+{
+    switch (code) {
+    case 0x03: return 9600;
+    case 0x04: return 19200;
+    case 0x05: return 31250;
+    case 0x06: return 38400;
+    case 0x07: return 76800;
+    case 0x08: return 153600;
+    case 0x09: return 57600;
+    case 0x0a: return 115200;
+    case 0x0b: return 128000;
+    default:   return 0;
+    }
+}
+
+static uint8_t odd_parity(uint8_t c)
+{
+    return (__builtin_popcount(c & 0x7f) & 1) ? (c & 0x7f) : (c | 0x80);
+}
+
+static void sim_send_signature(struct V850Sim *sim, uint64_t t)
+{
+    uint8_t sig[29];
+    memset(sig, 0x00, sizeof(sig));
+    sig[0] = 0x10;      /* VEN: NEC */
+    sig[1] = 0x7f;      /* MET */
+    sig[2] = 0x04;      /* MSC */
+    uint32_t end = sim->flash_size - 1;
+    sig[5] = end & 0xff;
+    sig[6] = (end >> 8) & 0xff;
+    sig[7] = (end >> 16) & 0xff;
+    for (int i = 0; i < 10; i++) {
+        sig[17 + i] = odd_parity(sim->device_name[i]);
+    }
+    sig[27] = 0xff;     /* SCF: no security flags set */
+    sig[28] = 0x00;     /* BOT */
+    sim_send_frame(sim, max_u64(t, sim->busy_until), sig, sizeof(sig), V850ESJx3L_ETX);
+}
+
+static void sim_send_read_frame(struct V850Sim *sim, uint64_t t)
+{
+    size_t length = sim->end + 1 - sim->address;
+    if (length > 256)
+        length = 256;
+    bool last = (sim->address + length == sim->end + 1);
+    sim_send_frame(sim, max_u64(t, sim->busy_until), sim->flash + sim->address, length,
+                   last ? V850ESJx3L_ETX : V850ESJx3L_ETB);
+    sim->address += length;
+}
+
+static void sim_command(struct V850Sim *sim, const struct V850Frame *frame, uint64_t t)
+{
+    uint8_t command = frame->data[0];
+    const uint8_t *param = frame->data + 1;
+    size_t param_length = frame->length - 1;
+    uint32_t start, end;
+    bool range = sim_decode_range(sim, param, param_length, &start, &end);
+
+    if (command != V850ESJx3L_STATUS)
+        sim->mode = SIM_IDLE;
+
+    switch (command) {
+    case V850ESJx3L_RESET:
+        sim_send_status(sim, t, V850ESJx3L_STATUS_ACK);
+        break;
+    case V850ESJx3L_OSC_FREQUENCY_SET:
+        sim_send_status(sim, t, (param_length == 4) ? V850ESJx3L_STATUS_ACK
+                                                    : V850ESJx3L_STATUS_PARAM_ERROR);
+        break;
+    case V850ESJx3L_BAUD_RATE_SET: {
+        uint32_t baud_rate = (param_length == 1) ? sim_baud_rate(param[0]) : 0;
+        if (baud_rate == 0) {
+            sim_send_status(sim, t, V850ESJx3L_STATUS_PARAM_ERROR);
+            break;
+        }
+        /* Acknowledged at the old rate, then switched */
+        sim_send_status(sim, t, V850ESJx3L_STATUS_ACK);
+        sim->device_baud_rate = baud_rate;
+        break;
+    }
+    case V850ESJx3L_SILICON_SIGNATURE:
+        sim_send_status(sim, t, V850ESJx3L_STATUS_ACK);
+        sim_send_signature(sim, t);
+        break;
+    case V850ESJx3L_CHIP_ERASE:
+        sim_busy(sim, t, SIM_CHIP_ERASE_NS);
+        memset(sim->flash, 0xff, sim->flash_size);
+        sim_accept(sim, t);
+        break;
+    case V850ESJx3L_BLOCK_ERASE:
+        if (!range) {
+            sim_send_status(sim, t, V850ESJx3L_STATUS_PARAM_ERROR);
+            break;
+        }
+        sim_busy(sim, t, SIM_BLOCK_ERASE_NS *
+                         ((end - start + V850ESJx3L_BLOCK_SIZE) / V850ESJx3L_BLOCK_SIZE));
+        memset(sim->flash + start, 0xff, end - start + 1);
+        sim_accept(sim, t);
+        break;
+    case V850ESJx3L_BLOCK_BLANK_CHECK: {
+        if (!range) {
+            sim_send_status(sim, t, V850ESJx3L_STATUS_PARAM_ERROR);
+            break;
+        }
+        sim_busy(sim, t, SIM_BLANK_CHECK_NS *
+                         ((end - start + V850ESJx3L_BLOCK_SIZE) / V850ESJx3L_BLOCK_SIZE));
+        bool blank = true;
+        for (uint32_t a = start; a <= end && blank; a++) {
+            blank = (sim->flash[a] == 0xff);
+        }
+        sim_send_status(sim, t, blank ? V850ESJx3L_STATUS_ACK : V850ESJx3L_STATUS_MRG11_ERROR);
+        break;
+    }
+    case V850ESJx3L_PROGRAMMING:
+    case V850ESJx3L_VERIFY:
+    case V850ESJx3L_READ:
+        if (!range) {
+            sim_send_status(sim, t, V850ESJx3L_STATUS_PARAM_ERROR);
+            break;
+        }
+        sim->address = start;
+        sim->end = end;
+        sim_send_status(sim, t, V850ESJx3L_STATUS_ACK);
+        if (command == V850ESJx3L_PROGRAMMING) {
+            sim->mode = SIM_PROGRAM;
+        } else if (command == V850ESJx3L_VERIFY) {
+            sim->mode = SIM_VERIFY;
+        } else {
+            sim->mode = SIM_READ;
+            sim_send_read_frame(sim, t);
+        }
+        break;
+    case V850ESJx3L_CHECKSUM: {
+        if (!range || (start & 0xff) != 0x00 || (end & 0xff) != 0xff) {
+            sim_send_status(sim, t, V850ESJx3L_STATUS_PARAM_ERROR);
+            break;
+        }
+        uint16_t sum = 0x0000;
+        for (uint32_t a = start; a <= end; a++) {
+            sum -= sim->flash[a];
+        }
+        uint8_t buf[2] = { sum >> 8, sum & 0xff };
+        sim_send_status(sim, t, V850ESJx3L_STATUS_ACK);
+        sim_send_frame(sim, max_u64(t, sim->busy_until), buf, 2, V850ESJx3L_ETX);
+        break;
+    }
+    case V850ESJx3L_STATUS: {
+        /* Answered right away, even while an operation is in progress */
+        uint8_t busy = V850ESJx3L_STATUS_BUSY;
+        if (t < sim->busy_until) {
+            sim_send_frame(sim, t, &busy, 1, V850ESJx3L_ETX);
+        } else {
+            sim_send_frame(sim, t, sim->status, 2, V850ESJx3L_ETX);
+        }
+        break;
+    }
+    default:
+        sim_send_status(sim, t, V850ESJx3L_STATUS_COMMAND_ERROR);
+        break;
+    }
+}
+
+static void sim_data(struct V850Sim *sim, const struct V850Frame *frame, uint64_t t)
+{
+    switch (sim->mode) {
+    case SIM_PROGRAM:
+    case SIM_VERIFY: {
+        if (sim->address + frame->length > sim->end + 1) {
+            sim->mode = SIM_IDLE;
+            sim_send_status2(sim, t, V850ESJx3L_STATUS_PARAM_ERROR, V850ESJx3L_STATUS_PARAM_ERROR);
+            break;
+        }
+        uint8_t st2 = V850ESJx3L_STATUS_ACK;
+        uint8_t *flash = sim->flash + sim->address;
+        if (sim->mode == SIM_PROGRAM) {
+            sim_busy(sim, t, SIM_PROGRAM_NS_PER_256 * frame->length / 256);
+            for (size_t i = 0; i < frame->length; i++) {
+                flash[i] &= frame->data[i];
+                if (flash[i] != frame->data[i])
+                    st2 = V850ESJx3L_STATUS_WRITE_ERROR;
+            }
+        } else if (memcmp(flash, frame->data, frame->length) != 0) {
+            st2 = V850ESJx3L_STATUS_VERIFY_ERROR;
+        }
+        sim->address += frame->length;
+        sim_send_status2(sim, t, V850ESJx3L_STATUS_ACK, st2);
+        if (frame->end == V850ESJx3L_ETX) {
+            if (sim->mode == SIM_PROGRAM) {
+                /* Internal verify */
+                sim_send_status(sim, t, (sim->address == sim->end + 1)
+                                        ? V850ESJx3L_STATUS_ACK : V850ESJx3L_STATUS_WRITE_ERROR);
+            }
+            sim->mode = SIM_IDLE;
+        }
+        break;
+    }
+    case SIM_READ:
+        if (frame->data[0] == V850ESJx3L_STATUS_ACK && sim->address <= sim->end) {
+            sim_send_read_frame(sim, t);
+        } else {
+            sim->mode = SIM_IDLE;
+        }
+        break;
+    default:
+        sim_send_status(sim, t, V850ESJx3L_STATUS_COMMAND_ERROR);
+        break;
+    }
+}
+
+static void sim_receive(struct V850Sim *sim, const uint8_t *data, size_t length, uint64_t t)
+{
+    size_t i = 0;
+    while (i < length) {
+        if (!sim->flash_mode) {
+            /* Two 00H bytes select UART communication */
+            if (data[i++] == 0x00 && ++sim->sync_count == 2)
+                sim->flash_mode = true;
+            continue;
+        }
+
+        size_t consumed;
+        const struct V850Frame *frame;
+        int ret = v850j_frame_parse(&sim->parser, data + i, length - i, &consumed, &frame);
+        i += consumed;
+        if (ret == V850J_FRAME_ERROR_CHECKSUM) {
+            sim_send_status(sim, t, V850ESJx3L_STATUS_CHECKSUM_ERROR);
+        } else if (ret == 1 && frame->type == V850ESJx3L_SOH) {
+            sim_command(sim, frame, t);
+        } else if (ret == 1) {
+            sim_data(sim, frame, t);
+        }
+    }
+}
+
+/* Arm timer_fd for the time the next packet reaches the host */
+static void sim_arm(struct V850Sim *sim)
+{
+#ifdef __linux__
+    if (sim->timer_fd < 0)
+        return;
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (sim->out_tail != sim->out_head) {
+        uint64_t t = sim->out_ready[sim->out_tail % SIM_OUT_SIZE] + SIM_USB_FRAME_NS;
+        its.it_value.tv_sec = t / 1000000000ULL;
+        its.it_value.tv_nsec = t % 1000000000ULL;
+    }
+    /* Setting the timer also clears a pending expiration */
+    timerfd_settime(sim->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+#endif
+}
+
+static void sim_power_on_reset(struct V850Sim *sim)
+{
+    sim->running = true;
+    sim->flash_mode = false;
+    sim->sync_count = 0;
+    sim->device_baud_rate = 9600;
+    sim->mode = SIM_IDLE;
+    sim->status[0] = sim->status[1] = V850ESJx3L_STATUS_ACK;
+    v850j_frame_parser_reset(&sim->parser);
+    sim->out_tail = sim->out_head;
+}
+
+static int sim_control(struct UART78K0 *uart, const uint8_t *req, int length, int timeout)
+{
+    struct V850Sim *sim = uart->backend_opaque;
+    switch (req[0]) {
+    case USB_78K0_REQUEST_LINE_CONTROL:
+        sim->host_baud_rate = req[1] | (req[2] << 8) | (req[3] << 16) | ((uint32_t)req[4] << 24);
+        break;
+    case USB_78K0_REQUEST_SET_DTR_RTS: {
+        /* RTS drives the target's RESET line */
+        bool rts = (req[1] & USB_78K0_SET_DTR_RTS_RTS_ON) != 0;
+        if (sim->rts && !rts) {
+            sim->running = false;
+        } else if (!sim->rts && rts) {
+            sim_power_on_reset(sim);
+        }
+        sim->rts = rts;
+        break;
+    }
+    default:
+        break;
+    }
+    return length;
+}
+
+static int sim_write(struct UART78K0 *uart, uint8_t *data, int length, int *transferred, int timeout)
+{
+    struct V850Sim *sim = uart->backend_opaque;
+    uint64_t t = max_u64(now_ns(), sim->rx_free_at) + length * byte_ns(sim->host_baud_rate);
+    sim->rx_free_at = t;
+    /* A non-blocking caller only queues the bytes, like a tty */
+    if (timeout > 0)
+        sleep_until(t);
+    if (sim_link_ok(sim) && sim->host_baud_rate == sim->device_baud_rate) {
+        sim_receive(sim, data, length, t);
+    }
+    sim_arm(sim);
+    *transferred = length;
+    return LIBUSB_SUCCESS;
+}
+
+static int sim_read(struct UART78K0 *uart, uint8_t *data, int length, int *transferred, int timeout)
+{
+    struct V850Sim *sim = uart->backend_opaque;
+    uint64_t deadline = now_ns() + timeout * 1000000ULL;
+    *transferred = 0;
+
+    /* Bytes sent at a rate the host is not listening at are lost */
+    while (sim->out_tail != sim->out_head &&
+           sim->out_baud_rate[sim->out_tail % SIM_OUT_SIZE] != sim->host_baud_rate) {
+        sim->out_tail++;
+    }
+    if (sim->out_tail == sim->out_head ||
+        sim->out_ready[sim->out_tail % SIM_OUT_SIZE] + SIM_USB_FRAME_NS > deadline) {
+        sleep_until(deadline);
+        sim_arm(sim);
+        return LIBUSB_ERROR_TIMEOUT;
+    }
+
+    uint64_t packet_time = sim->out_ready[sim->out_tail % SIM_OUT_SIZE] + SIM_USB_FRAME_NS;
+    sleep_until(packet_time);
+    while (sim->out_tail != sim->out_head && *transferred < length) {
+        size_t index = sim->out_tail % SIM_OUT_SIZE;
+        if (sim->out_ready[index] > packet_time)
+            break;
+        if (sim->out_baud_rate[index] == sim->host_baud_rate)
+            data[(*transferred)++] = sim->out[index];
+        sim->out_tail++;
+    }
+    sim_arm(sim);
+    return LIBUSB_SUCCESS;
+}
+
+#ifdef __linux__
+static int sim_fd(struct UART78K0 *uart)
+{
+    struct V850Sim *sim = uart->backend_opaque;
+    if (sim->timer_fd < 0) {
+        sim->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        sim_arm(sim);
+    }
+    return sim->timer_fd;
+}
+#endif
+
+static const struct UART78K0Backend sim_backend = {
+    .control = sim_control,
+    .write = sim_write,
+    .read = sim_read,
+#ifdef __linux__
+    .fd = sim_fd,
+#endif
+};
+
+struct V850Sim *v850j_sim_new(const char *device_name, size_t flash_size, uint32_t max_baud_rate)
+{
+    struct V850Sim *sim = calloc(1, sizeof(struct V850Sim));
+    snprintf(sim->device_name, sizeof(sim->device_name), "%-10s", device_name);
+    sim->flash = malloc(flash_size);
+    memset(sim->flash, 0xff, flash_size);
+    sim->flash_size = flash_size;
+    sim->max_baud_rate = max_baud_rate;
+    sim->host_baud_rate = 9600;
+    sim->timer_fd = -1;
+    sim_power_on_reset(sim);
+    return sim;
+}
+
+void v850j_sim_free(struct V850Sim *sim)
+{
+    if (sim->timer_fd >= 0)
+        close(sim->timer_fd);
+    free(sim->flash);
+    free(sim);
+}
+
+void v850j_sim_attach(struct V850Sim *sim, struct UART78K0 *uart)
+{
+    uart->handle = NULL;
+    uart->backend = &sim_backend;
+    uart->backend_opaque = sim;
+}
+
+const uint8_t *v850j_sim_flash(struct V850Sim *sim)
+{
+    return sim->flash;
+}
@@ -0,0 +1,26 @@
+/*
+ * Simulated Renesas V850ES/Jx3-L flash bootloader
+ *
+ * Copyright (c) 2011-2012 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU LGPL version 2.1 or (at your option) any later version.
+ */
+#ifndef V850J_SIM_H
+#define V850J_SIM_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "78k0_usb_uart.h"
+
+
+struct V850Sim;
+
+struct V850Sim *v850j_sim_new(const char *device_name, size_t flash_size, uint32_t max_baud_rate);
+void v850j_sim_free(struct V850Sim *sim);
+void v850j_sim_attach(struct V850Sim *sim, struct UART78K0 *uart);
+const uint8_t *v850j_sim_flash(struct V850Sim *sim);
+
+
+#endif
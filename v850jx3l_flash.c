@@ -6,128 +6,204 @@
  * Licensed under the GNU LGPL version 2.1 or (at your option) any later version.
  */
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <inttypes.h>
-#include <unistd.h>
+#include <errno.h>
+#include <time.h>
 #include <libusb-1.0/libusb.h>
 #include "v850j.h"
 #include "78k0_usb_uart.h"
+#include "bswap.h"
+#include "checksum.h"
+#include "trace.h"
+#include "stats.h"
 
-#define V850J_TIMEOUT_MS (3000 + 1000)
+#define V850J_DEFAULT_FX 5000000
+#define V850J_AUTOTUNE_TRIALS 3
+#define V850J_NEGOTIATE_TRIES 2
+#define V850J_NEGOTIATE_TIMEOUT_MS 250
+#define V850J_AUTOTUNE_MARGIN_PERCENT 25
 
-static uint8_t checksum(uint8_t *data, size_t data_length)
+/*
+ * Erase planner costs in microseconds, per block where noted. Erase times
+ * are measured on each board (dev->erase_costs); until then a block erase
+ * is assumed to take V850J_COST_BLOCK_ERASE_US and a chip erase as long as
+ * erasing every block in turn, so it only wins on an all but fully dirty
+ * device. Command and blank check costs are estimates of a round trip at
+ * the usual baud rates.
+ */
+#define V850J_COST_COMMAND_US       2000
+#define V850J_COST_BLANK_CHECK_US   500
+#define V850J_COST_BLOCK_ERASE_US   10000
+
+static uint16_t block_checksum(const uint8_t *data, size_t data_length)
 {
-    uint8_t checksum = 0x00;
-    for (size_t i = 0; i < data_length; i++) {
-        checksum -= data[i];
-    }
-    return checksum;
+    return -checksum_sum(data, data_length);
 }
 
-static int send_command_frame(struct V850Device *dev, uint8_t command,
-                              const uint8_t *buffer, uint8_t buffer_length)
+static int send_frame(struct V850Device *dev, const struct iovec *iov, int iovcnt, size_t length)
 {
-    uint8_t buf[3 + 255 + 2];
-    buf[0] = V850ESJx3L_SOH;
-    buf[1] = (buffer_length == 255) ? 0 : (buffer_length + 1);
-    buf[2] = command;
-    if (buffer_length > 0)
-        memcpy(&buf[3], buffer, buffer_length);
-    buf[3 + buffer_length] = checksum(&buf[1], buffer_length + 2);
-    buf[3 + buffer_length + 1] = V850ESJx3L_ETX;
-
-    printf("Sending command frame:");
-    for(int i = 0; i < buffer_length + 5; i++) {
-        printf(" %02" PRIX8, buf[i]);
-    }
-    printf("\n");
-
+    dev->stats_start = STATS_START();
     int transferred;
-    int ret = usb_78k0_write(&dev->uart, buf, buffer_length + 5, &transferred, V850J_TIMEOUT_MS);
+    int ret = usb_78k0_writev(&dev->uart, iov, iovcnt, &transferred, V850J_TIMEOUT_MS);
     if (ret != LIBUSB_SUCCESS) {
         fprintf(stderr, "%s: sending failed: %d\n", __func__, ret);
         return -1;
     }
-    if (transferred != buffer_length + 5) {
-        fprintf(stderr, "%s: transferred unexpected amount: %d (%d)\n", __func__, transferred, buffer_length + 5);
+    if (transferred != length) {
+        fprintf(stderr, "%s: transferred unexpected amount: %d (%zu)\n", __func__, transferred, length);
         return -1;
     }
-
     return 0;
 }
 
-static int receive_data_frame(struct V850Device *dev, uint8_t *buffer, size_t *length)
+static int send_command_frame(struct V850Device *dev, uint8_t command,
+                              const uint8_t *buffer, uint8_t buffer_length)
 {
-    uint8_t buf[2 + 256 + 2];
-    int transferred = 0;
-    int ret = usb_78k0_read(&dev->uart, buf, 2, &transferred, V850J_TIMEOUT_MS);
-    if (ret != LIBUSB_SUCCESS) {
-        fprintf(stderr, "%s: receiving header failed: %d (transferred %d)\n", __func__, ret, transferred);
-        return -1;
-    }
-    if (buf[0] != V850ESJx3L_STX) {
-        fprintf(stderr, "%s: no data frame: %02" PRIX8 "\n", __func__, buf[0]);
-        return -1;
-    }
-    if (transferred < 2) {
-        ret = usb_78k0_read(&dev->uart, buf + 1, 1, &transferred, V850J_TIMEOUT_MS);
-        if (ret != LIBUSB_SUCCESS) {
-            fprintf(stderr, "%s: receiving length failed: %d\n", __func__, ret);
-            return -1;
+    /* Only header and trailer are built, the parameters go out from buffer */
+    struct V850FrameIov frame;
+    size_t length = v850j_command_frame_iov(&frame, command, buffer, buffer_length);
+
+    dev->stats_slot = command;
+    return send_frame(dev, frame.iov, 3, length);
+}
+
+static int send_data_frame(struct V850Device *dev, const uint8_t *buf, size_t length)
+{
+    struct iovec iov = { (void *)buf, length };
+
+    dev->stats_slot = STATS_DATA_FRAME;
+    return send_frame(dev, &iov, 1, length);
+}
+
+/*
+ * Feed received bytes to the frame parser until a complete frame is there.
+ * Bytes following that frame in the same USB packet are kept for the next
+ * call, so a status frame and the data frame after it need only one read.
+ */
+static int receive_frame(struct V850Device *dev, const struct V850Frame **frame, int timeout_ms)
+{
+    while (true) {
+        if (dev->rx_pos == dev->rx_length) {
+            int transferred = 0;
+            int ret = usb_78k0_read(&dev->uart, dev->rx_buffer, sizeof(dev->rx_buffer),
+                                    &transferred, timeout_ms);
+            if (ret != LIBUSB_SUCCESS) {
+                fprintf(stderr, "%s: receiving failed: %d (transferred %d)\n", __func__, ret, transferred);
+                v850j_frame_parser_reset(&dev->parser);
+                return -1;
+            }
+            dev->rx_pos = 0;
+            dev->rx_length = transferred;
+            continue;
         }
-    }
-    size_t len = (buf[1] == 0) ? 256 : buf[1];
 
-    int received = 0;
-    do {
-        ret = usb_78k0_read(&dev->uart, buf + 2 + received, len + 2 - received, &transferred, V850J_TIMEOUT_MS);
-        if (ret != LIBUSB_SUCCESS) {
-            fprintf(stderr, "%s: receiving data failed: %d\n", __func__, ret);
+        size_t consumed;
+        int ret = v850j_frame_parse(&dev->parser, dev->rx_buffer + dev->rx_pos,
+                                    dev->rx_length - dev->rx_pos, &consumed, frame);
+        dev->rx_pos += consumed;
+        if (ret == 0)
+            continue;
+        if (ret < 0) {
+            fprintf(stderr, "%s: invalid frame: %d\n", __func__, ret);
+            /* Resynchronize on the next packet */
+            dev->rx_pos = dev->rx_length;
             return -1;
         }
-        if (ret == 0)
-            received += transferred;
-    } while (received < len + 2);
-
-    if (buf[2 + len] != checksum(buf + 1, len + 1)) {
-        fprintf(stderr, "%s: checksum mismatch\n", __func__);
+        if ((*frame)->type != V850ESJx3L_STX) {
+            fprintf(stderr, "%s: no data frame: %02" PRIX8 "\n", __func__, (*frame)->type);
+            return -1;
+        }
+        /* Only the first response measures the round trip */
+        if (dev->stats_start != 0) {
+            STATS_LATENCY(dev->stats_slot, dev->stats_start);
+            dev->stats_start = 0;
+        }
+        return 0;
     }
+}
 
-    printf("Received data frame:");
-    for(int i = 0; i < len + 4; i++) {
-        printf(" %02" PRIX8, buf[i]);
-    }
-    printf("\n");
+static int receive_data_frame_timeout(struct V850Device *dev, uint8_t *buffer, size_t *length,
+                                      int timeout_ms)
+{
+    const struct V850Frame *frame;
+    int ret = receive_frame(dev, &frame, timeout_ms);
+    if (ret != 0)
+        return ret;
 
-    memcpy(buffer, buf + 2, len);
-    *length = len;
+    memcpy(buffer, frame->data, frame->length);
+    *length = frame->length;
     return 0;
 }
 
-static uint32_t fxx(void)
+static int receive_data_frame(struct V850Device *dev, uint8_t *buffer, size_t *length)
+{
+    return receive_data_frame_timeout(dev, buffer, length, V850J_TIMEOUT_MS);
+}
+
+static uint32_t fxx(struct V850Device *dev)
 {
-    uint32_t fx = 5000000;
+    uint32_t fx = (dev->fx != 0) ? dev->fx : V850J_DEFAULT_FX;
     return fx * 4;
 }
 
-static void wait_tCOM(void)
+void v850j_default_timings(struct V850Device *dev, struct V850Timings *timings)
+{
+    timings->t12 = (30000.0 / fxx(dev)) * 1000000;
+    timings->t2C = (30000.0 / fxx(dev)) * 1000000;
+    timings->tCOM = (620.0 / fxx(dev)) * 1000000 + 15;
+    timings->tWT10 = (2384.0 / fxx(dev)) * 1000000;
+}
+
+const struct V850Timings *v850j_timings(struct V850Device *dev)
 {
-    useconds_t tCOM = (620.0 / fxx()) * 1000000 + 15;
-    printf("tCOM = %u\n", tCOM);
-    usleep(tCOM);
+    if (!dev->timings_tuned)
+        v850j_default_timings(dev, &dev->timings);
+    return &dev->timings;
+}
+
+/*
+ * Wait until us have passed since the last transfer moved data or changed
+ * the line state, e.g. released the reset pulse on RTS. Sleeping to an
+ * absolute deadline does not add up the oversleep of relative sleeps, and
+ * time spent on the next frame already counts towards the gap.
+ */
+static void wait_us(struct V850Device *dev, uint32_t us)
+{
+    uint32_t le_us = cpu_to_le32(us);
+    TRACE(TRACE_WAIT, &le_us, sizeof(le_us));
+    uint64_t start = stats_now();
+    uint64_t deadline = dev->uart.last_transfer + us * UINT64_C(1000);
+    if (deadline > start) {
+        struct timespec ts;
+        ts.tv_sec = deadline / 1000000000ULL;
+        ts.tv_nsec = deadline % 1000000000ULL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+        }
+    }
+    STATS_TIME(STATS_SLEEP, start);
+}
+
+static void wait_tCOM(struct V850Device *dev)
+{
+    wait_us(dev, v850j_timings(dev)->tCOM);
 }
 
 int v850j_reset(struct V850Device *dev)
 {
     int ret;
-    useconds_t t12 = (30000.0 / fxx()) * 1000000;
-    printf("t12 = %u\n", t12);
-    useconds_t t2C = (30000.0 / fxx()) * 1000000;
-    printf("t2C = %u\n", t2C);
+    uint32_t t12 = v850j_timings(dev)->t12;
+    uint32_t t2C = v850j_timings(dev)->t2C;
+
+    /* Drop anything left over from a previous session */
+    dev->rx_pos = dev->rx_length = 0;
+    v850j_frame_parser_reset(&dev->parser);
+    dev->baud_rate = 9600;
 
-    wait_tCOM();
+    wait_tCOM(dev);
     ret = v850j_78k0_line_control(&dev->uart,
                                   9600,
                                   USB_78K0_LINE_CONTROL_FLOW_CONTROL_NONE |
@@ -142,7 +218,7 @@ int v850j_reset(struct V850Device *dev)
         fprintf(stderr, "%s: sending (i) failed: %d\n", __func__, ret);
         return -1;
     }
-    usleep(t12);
+    wait_us(dev, t12);
 
     x = 0x00;
     ret = usb_78k0_write(&dev->uart, &x, 1, &transferred, V850J_TIMEOUT_MS);
@@ -150,7 +226,7 @@ int v850j_reset(struct V850Device *dev)
         fprintf(stderr, "%s: sending (ii) failed: %d\n", __func__, ret);
         return -1;
     }
-    usleep(t2C);
+    wait_us(dev, t2C);
 
     ret = send_command_frame(dev, V850ESJx3L_RESET, NULL, 0);
     if (ret != 0)
@@ -167,9 +243,64 @@ int v850j_reset(struct V850Device *dev)
     return 0;
 }
 
+/* Flash layout of known parts, matched by signature device name */
+static const struct V850Geometry v850j_geometries[] = {
+    /* V850ES/JF3-L */
+    { "D70F3735", 128 * 1024, V850ESJx3L_BLOCK_SIZE, 32 },
+    { "D70F3736", 256 * 1024, V850ESJx3L_BLOCK_SIZE, 64 },
+    /* V850ES/JG3-L */
+    { "D70F3737", 128 * 1024, V850ESJx3L_BLOCK_SIZE, 32 },
+    { "D70F3738", 256 * 1024, V850ESJx3L_BLOCK_SIZE, 64 },
+    { "D70F3792", 384 * 1024, V850ESJx3L_BLOCK_SIZE, 96 },
+    { "D70F3793", 512 * 1024, V850ESJx3L_BLOCK_SIZE, 128 },
+};
+
+static void signature_decode(struct V850Signature *sig, const uint8_t *buf)
+{
+    sig->vendor = buf[0] & 0x7f;
+    memcpy(sig->id, &buf[1], 4);
+    sig->flash_end = buf[5] | (buf[6] << 8) | (buf[7] << 16);
+    for (int i = 0; i < 10; i++) {
+        sig->name[i] = buf[5 + 3 * 4 + i] & 0x7f;
+    }
+    sig->name[10] = '\0';
+    sig->security = buf[27];
+    sig->boot = buf[28];
+}
+
+static void geometry_match(struct V850Device *dev)
+{
+    const struct V850Signature *sig = &dev->signature;
+    size_t name_length = strcspn(sig->name, " ");
+    for (size_t i = 0; i < sizeof(v850j_geometries) / sizeof(v850j_geometries[0]); i++) {
+        const struct V850Geometry *g = &v850j_geometries[i];
+        if (strlen(g->name) != name_length || strncmp(g->name, sig->name, name_length) != 0)
+            continue;
+        if (g->flash_size != sig->flash_end + 1) {
+            fprintf(stderr, "%s: %s reports 0x%06" PRIX32 " as flash end\n", __func__,
+                    g->name, sig->flash_end);
+            break;
+        }
+        dev->geometry = *g;
+        return;
+    }
+    /* Unknown part, trust the signature */
+    dev->geometry.name = NULL;
+    dev->geometry.flash_size = sig->flash_end + 1;
+    dev->geometry.block_size = V850ESJx3L_BLOCK_SIZE;
+    dev->geometry.blocks = dev->geometry.flash_size / V850ESJx3L_BLOCK_SIZE;
+}
+
+static void signature_print(struct V850Device *dev)
+{
+    printf("Device: '%s' (%" PRIu32 " KB in %" PRIu32 " blocks%s)\n", dev->signature.name,
+           dev->geometry.flash_size / 1024, dev->geometry.blocks,
+           (dev->geometry.name == NULL) ? ", unknown part" : "");
+}
+
 int v850j_get_silicon_signature(struct V850Device *dev)
 {
-    wait_tCOM();
+    wait_tCOM(dev);
 
     int ret;
     ret = send_command_frame(dev, V850ESJx3L_SILICON_SIGNATURE, NULL, 0);
@@ -187,15 +318,107 @@ int v850j_get_silicon_signature(struct V850Device *dev)
     ret = receive_data_frame(dev, buf, &len);
     if (ret != 0)
         return ret;
-    char device[11];
-    for (int i = 0; i < 10; i++) {
-        device[i] = buf[5 + 3 * 4 + i] & 0x7f;
+    if (len < 29) {
+        fprintf(stderr, "%s: short signature (%zu)\n", __func__, len);
+        return -1;
     }
-    device[10] = '\0';
-    printf("Device: '%s'\n", device);
+    signature_decode(&dev->signature, buf);
+    geometry_match(dev);
+    dev->signature_valid = true;
+    signature_print(dev);
     return 0;
 }
 
+int v850j_signature_load(struct V850Device *dev, const char *filename)
+{
+    FILE *f = fopen(filename, "r");
+    if (f == NULL)
+        return -1;
+    struct V850Signature sig;
+    memset(&sig, 0, sizeof(sig));
+    int fields = 0;
+    char line[64];
+    unsigned int value, id[4];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "vendor=%x", &value) == 1) {
+            sig.vendor = value;
+            fields |= 1 << 0;
+        } else if (sscanf(line, "id=%2x%2x%2x%2x", &id[0], &id[1], &id[2], &id[3]) == 4) {
+            for (int i = 0; i < 4; i++)
+                sig.id[i] = id[i];
+            fields |= 1 << 1;
+        } else if (sscanf(line, "end=%x", &value) == 1) {
+            sig.flash_end = value;
+            fields |= 1 << 2;
+        } else if (sscanf(line, "name=%10[^\n]", sig.name) == 1) {
+            fields |= 1 << 3;
+        } else if (sscanf(line, "security=%x", &value) == 1) {
+            sig.security = value;
+            fields |= 1 << 4;
+        } else if (sscanf(line, "boot=%x", &value) == 1) {
+            sig.boot = value;
+            fields |= 1 << 5;
+        }
+    }
+    fclose(f);
+    if (fields != 0x3f) {
+        fprintf(stderr, "%s: incomplete signature in %s\n", __func__, filename);
+        return -1;
+    }
+    dev->signature = sig;
+    geometry_match(dev);
+    dev->signature_valid = true;
+    signature_print(dev);
+    return 0;
+}
+
+int v850j_signature_save(struct V850Device *dev, const char *filename)
+{
+    if (!dev->signature_valid)
+        return -1;
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) {
+        perror(filename);
+        return -1;
+    }
+    const struct V850Signature *sig = &dev->signature;
+    fprintf(f, "vendor=%02" PRIX8 "\nid=%02" PRIX8 "%02" PRIX8 "%02" PRIX8 "%02" PRIX8 "\n"
+               "end=%06" PRIX32 "\nname=%s\nsecurity=%02" PRIX8 "\nboot=%02" PRIX8 "\n",
+            sig->vendor, sig->id[0], sig->id[1], sig->id[2], sig->id[3],
+            sig->flash_end, sig->name, sig->security, sig->boot);
+    return fclose(f);
+}
+
+int v850j_erase_costs_load(struct V850Device *dev, const char *filename)
+{
+    FILE *f = fopen(filename, "r");
+    if (f == NULL)
+        return -1;
+    char line[64];
+    unsigned int value;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "block=%u", &value) == 1) {
+            dev->erase_costs.block = value;
+        } else if (sscanf(line, "chip=%u", &value) == 1) {
+            dev->erase_costs.chip = value;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+int v850j_erase_costs_save(struct V850Device *dev, const char *filename)
+{
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) {
+        perror(filename);
+        return -1;
+    }
+    fprintf(f, "block=%" PRIu32 "\nchip=%" PRIu32 "\n",
+            dev->erase_costs.block, dev->erase_costs.chip);
+    return fclose(f);
+}
+
 int v850j_osc_frequency_set(struct V850Device *dev, uint32_t frequency)
 {
     int ret;
@@ -213,7 +436,7 @@ int v850j_osc_frequency_set(struct V850Device *dev, uint32_t frequency)
         }
     }
 
-    wait_tCOM();
+    wait_tCOM(dev);
 
     ret = send_command_frame(dev, V850ESJx3L_OSC_FREQUENCY_SET, buf, 4);
     if (ret != 0)
@@ -226,12 +449,14 @@ int v850j_osc_frequency_set(struct V850Device *dev, uint32_t frequency)
         fprintf(stderr, "%s: no ACK: %02" PRIX8 "\n", __func__, buf[0]);
         return -1;
     }
+    /* Later waits scale with the operating clock */
+    dev->fx = frequency;
     return 0;
 }
 
-int v850j_baud_rate_set(struct V850Device *dev, uint32_t baud_rate)
+static int baud_rate_set(struct V850Device *dev, uint32_t baud_rate, int tries, int timeout_ms)
 {
-    wait_tCOM();
+    wait_tCOM(dev);
 
     int ret;
     uint8_t buf[256];
@@ -273,6 +498,7 @@ int v850j_baud_rate_set(struct V850Device *dev, uint32_t baud_rate)
                             USB_78K0_LINE_CONTROL_PARITY_NONE |
                             USB_78K0_LINE_CONTROL_STOP_BITS_1 |
                             USB_78K0_LINE_CONTROL_DATA_SIZE_8;
+    usb_78k0_batch_begin(&dev->uart);
     ret = v850j_78k0_line_control(&dev->uart, baud_rate, line_settings);
     ret = v850j_78k0_set_err_chr(&dev->uart, false, '\0');
     ret = v850j_78k0_set_dtr_rts(&dev->uart, false, true);
@@ -283,25 +509,976 @@ int v850j_baud_rate_set(struct V850Device *dev, uint32_t baud_rate)
     ret = v850j_78k0_set_err_chr(&dev->uart, false, '\0');
     ret = v850j_78k0_line_control(&dev->uart, baud_rate, line_settings);
     ret = v850j_78k0_set_err_chr(&dev->uart, false, '\0');
+    ret = usb_78k0_batch_end(&dev->uart);
 
-    useconds_t tWT10 = (2384.0 / fxx()) * 1000000;
+    uint32_t tWT10 = v850j_timings(dev)->tWT10;
     int try = 0;
     do {
-        usleep(tWT10);
+        wait_us(dev, tWT10);
 
         ret = send_command_frame(dev, V850ESJx3L_RESET, NULL, 0);
         if (ret != 0) {
             return -1;
         }
         size_t len;
-        ret = receive_data_frame(dev, buf, &len);
+        ret = receive_data_frame_timeout(dev, buf, &len, timeout_ms);
         if (ret == 0) {
             if (buf[0] == V850ESJx3L_STATUS_ACK) {
+                dev->baud_rate = baud_rate;
                 return 0;
             }
             fprintf(stderr, "%s: no ACK: %02" PRIX8 "\n", __func__, buf[0]);
         }
         try++;
-    } while (try < 16);
+    } while (try < tries);
     return -1;
 }
+
+int v850j_baud_rate_set(struct V850Device *dev, uint32_t baud_rate)
+{
+    return baud_rate_set(dev, baud_rate, 16, V850J_TIMEOUT_MS);
+}
+
+/* Baud rates supported by BAUD_RATE_SET, fastest first */
+static const uint32_t v850j_baud_rates[] = {
+    153600, 128000, 115200, 76800, 57600, 38400, 31250, 19200, 9600,
+};
+
+int v850j_baud_rate_negotiate(struct V850Device *dev, uint32_t max_baud_rate, uint32_t *baud_rate)
+{
+    uint32_t frequency = (dev->fx != 0) ? dev->fx : V850J_DEFAULT_FX;
+    bool connected = true;
+    for (int i = 0; i < sizeof(v850j_baud_rates) / sizeof(v850j_baud_rates[0]); i++) {
+        uint32_t rate = v850j_baud_rates[i];
+        if (rate > max_baud_rate)
+            continue;
+
+        /* A failed attempt leaves the target at an unknown rate */
+        if (!connected && v850j_reenter(dev, frequency) != 0)
+            continue;
+        connected = false;
+
+        printf("Trying %" PRIu32 " baud...\n", rate);
+        if (baud_rate_set(dev, rate, V850J_NEGOTIATE_TRIES, V850J_NEGOTIATE_TIMEOUT_MS) != 0)
+            continue;
+        /* Confirm with a longer, checksummed frame */
+        if (v850j_get_silicon_signature(dev) != 0)
+            continue;
+
+        *baud_rate = rate;
+        return 0;
+    }
+    fprintf(stderr, "%s: no working baud rate\n", __func__);
+    return -1;
+}
+
+/*
+ * Poll STATUS with exponential backoff until the device is no longer
+ * BUSY, for at most timeout_ms, and check the finished operation's result.
+ * Bootloaders that only answer a command once it is done report its
+ * status on the first poll.
+ */
+static int wait_ready(struct V850Device *dev, int timeout_ms)
+{
+    uint64_t deadline = stats_now() + timeout_ms * UINT64_C(1000000);
+    uint32_t delay = V850J_POLL_INITIAL_US;
+    while (true) {
+        wait_tCOM(dev);
+        int ret = send_command_frame(dev, V850ESJx3L_STATUS, NULL, 0);
+        if (ret != 0)
+            return ret;
+        uint8_t buf[256];
+        size_t len;
+        ret = receive_data_frame(dev, buf, &len);
+        if (ret != 0)
+            return ret;
+        if (buf[0] != V850ESJx3L_STATUS_BUSY) {
+            if (buf[0] != V850ESJx3L_STATUS_ACK ||
+                (len >= 2 && buf[1] != V850ESJx3L_STATUS_ACK)) {
+                fprintf(stderr, "%s: operation failed: %02" PRIX8 " %02" PRIX8 "\n", __func__,
+                        buf[0], (len >= 2) ? buf[1] : V850ESJx3L_STATUS_ACK);
+                return -1;
+            }
+            return 0;
+        }
+        if (stats_now() >= deadline) {
+            fprintf(stderr, "%s: still busy after %d ms\n", __func__, timeout_ms);
+            return -1;
+        }
+        wait_us(dev, delay);
+        delay = (delay * 2 > V850J_POLL_MAX_US) ? V850J_POLL_MAX_US : delay * 2;
+    }
+}
+
+static size_t range_blocks(struct V850Device *dev, uint32_t start, uint32_t end)
+{
+    uint32_t block_size = dev->signature_valid ? dev->geometry.block_size : V850ESJx3L_BLOCK_SIZE;
+    return (end - start + block_size) / block_size;
+}
+
+int v850j_range_timeout_ms(struct V850Device *dev, uint32_t start, uint32_t end)
+{
+    return V850J_TIMEOUT_MS + range_blocks(dev, start, end) * V850J_BLOCK_TIMEOUT_MS;
+}
+
+int v850j_chip_erase(struct V850Device *dev)
+{
+    wait_tCOM(dev);
+
+    int ret;
+    uint64_t t0 = stats_now();
+    ret = send_command_frame(dev, V850ESJx3L_CHIP_ERASE, NULL, 0);
+    if (ret != 0)
+        return ret;
+    uint8_t buf[256];
+    size_t len;
+    ret = receive_data_frame_timeout(dev, buf, &len, V850J_CHIP_ERASE_TIMEOUT_MS);
+    if (ret != 0)
+        return ret;
+    if (buf[0] != V850ESJx3L_STATUS_ACK) {
+        fprintf(stderr, "%s: no ACK: %02" PRIX8 "\n", __func__, buf[0]);
+        return -1;
+    }
+    ret = wait_ready(dev, V850J_CHIP_ERASE_TIMEOUT_MS);
+    if (ret == 0)
+        dev->erase_costs.chip = (stats_now() - t0) / 1000;
+    return ret;
+}
+
+int v850j_block_erase(struct V850Device *dev, uint32_t start, uint32_t end)
+{
+    int ret;
+    uint8_t buf[256];
+    size_t len;
+    v850j_address_encode(&buf[0], start);
+    v850j_address_encode(&buf[3], end);
+
+    wait_tCOM(dev);
+
+    int timeout_ms = v850j_range_timeout_ms(dev, start, end);
+    uint64_t t0 = stats_now();
+    ret = send_command_frame(dev, V850ESJx3L_BLOCK_ERASE, buf, 6);
+    if (ret != 0)
+        return ret;
+    ret = receive_data_frame_timeout(dev, buf, &len, timeout_ms);
+    if (ret != 0)
+        return ret;
+    if (buf[0] != V850ESJx3L_STATUS_ACK) {
+        fprintf(stderr, "%s: no ACK: %02" PRIX8 "\n", __func__, buf[0]);
+        return -1;
+    }
+    ret = wait_ready(dev, timeout_ms);
+    if (ret == 0)
+        dev->erase_costs.block = (stats_now() - t0) / 1000 / range_blocks(dev, start, end);
+    return ret;
+}
+
+int v850j_blank_check(struct V850Device *dev, uint32_t start, uint32_t end, bool *blank)
+{
+    int ret;
+    uint8_t buf[256];
+    size_t len;
+    v850j_address_encode(&buf[0], start);
+    v850j_address_encode(&buf[3], end);
+
+    wait_tCOM(dev);
+
+    ret = send_command_frame(dev, V850ESJx3L_BLOCK_BLANK_CHECK, buf, 6);
+    if (ret != 0)
+        return ret;
+    ret = receive_data_frame_timeout(dev, buf, &len, v850j_range_timeout_ms(dev, start, end));
+    if (ret != 0)
+        return ret;
+    if (buf[0] == V850ESJx3L_STATUS_MRG11_ERROR) {
+        *blank = false;
+        return 0;
+    }
+    if (buf[0] != V850ESJx3L_STATUS_ACK) {
+        fprintf(stderr, "%s: no ACK: %02" PRIX8 "\n", __func__, buf[0]);
+        return -1;
+    }
+    *blank = true;
+    return 0;
+}
+
+static void mark_dirty(bool *dirty, size_t first, size_t count)
+{
+    for (size_t i = first; i < first + count; i++) {
+        dirty[i] = true;
+    }
+}
+
+/*
+ * Narrow down a run of blocks known not to be blank. Only the first half
+ * is checked: if it is blank, the dirt is all in the second. Bisecting
+ * stops once both halves turn out dirty, as for firmware being reflashed,
+ * or when erasing the run is cheaper than the two checks it may save.
+ */
+static int plan_dirty(struct V850Device *dev, size_t first, size_t count, size_t block_size,
+                      uint64_t block_cost, bool *dirty)
+{
+    size_t half = count / 2;
+    if (count == 1 ||
+        half * block_cost <= 2 * (V850J_COST_COMMAND_US + half * V850J_COST_BLANK_CHECK_US)) {
+        mark_dirty(dirty, first, count);
+        return 0;
+    }
+    bool blank;
+    int ret = v850j_blank_check(dev, first * block_size, (first + half) * block_size - 1, &blank);
+    if (ret != 0)
+        return ret;
+    if (blank)
+        return plan_dirty(dev, first + half, count - half, block_size, block_cost, dirty);
+    ret = v850j_blank_check(dev, (first + half) * block_size, (first + count) * block_size - 1, &blank);
+    if (ret != 0)
+        return ret;
+    if (blank)
+        return plan_dirty(dev, first, half, block_size, block_cost, dirty);
+    mark_dirty(dirty, first, count);
+    return 0;
+}
+
+/* Blank-check a run of blocks as a whole, then narrow it down if dirty */
+static int plan_blank_check(struct V850Device *dev, size_t first, size_t count, size_t block_size,
+                            uint64_t block_cost, bool *dirty)
+{
+    bool blank;
+    int ret = v850j_blank_check(dev, first * block_size, (first + count) * block_size - 1, &blank);
+    if (ret != 0 || blank)
+        return ret;
+    return plan_dirty(dev, first, count, block_size, block_cost, dirty);
+}
+
+int v850j_erase_planned(struct V850Device *dev, const struct V850Range *ranges, size_t num_ranges,
+                        size_t block_size, bool allow_chip_erase)
+{
+    uint32_t flash_size = dev->signature_valid ? dev->geometry.flash_size : 0x1000000;
+    size_t blocks = flash_size / block_size;
+    for (size_t i = 0; i < num_ranges; i++) {
+        if ((ranges[i].start % block_size) != 0 || ((ranges[i].end + 1) % block_size) != 0 ||
+            ranges[i].end < ranges[i].start || ranges[i].end >= flash_size) {
+            fprintf(stderr, "%s: invalid range 0x%06" PRIX32 "-0x%06" PRIX32 "\n", __func__,
+                    ranges[i].start, ranges[i].end);
+            return -1;
+        }
+    }
+
+    uint64_t block_cost = dev->erase_costs.block ? dev->erase_costs.block : V850J_COST_BLOCK_ERASE_US;
+    uint64_t chip_cost = dev->erase_costs.chip ? dev->erase_costs.chip : blocks * block_cost;
+
+    bool *dirty = calloc(blocks, sizeof(bool));
+    /* Blocks inside the ranges, which are the only ones blank-checked */
+    bool *checked = calloc(blocks, sizeof(bool));
+    int ret = 0;
+    for (size_t i = 0; i < num_ranges && ret == 0; i++) {
+        size_t first = ranges[i].start / block_size;
+        size_t count = (ranges[i].end + 1) / block_size - first;
+        for (size_t j = first; j < first + count; j++) {
+            checked[j] = true;
+        }
+        ret = plan_blank_check(dev, first, count, block_size, block_cost, dirty);
+    }
+    if (ret != 0) {
+        free(checked);
+        free(dirty);
+        return ret;
+    }
+
+    /*
+     * Join dirty blocks into runs, also across gaps that are cheaper to
+     * erase along than to skip with another command. Gaps must have been
+     * found blank; blocks outside the ranges may hold data to keep.
+     */
+    size_t num_runs = 0, erase_blocks = 0;
+    size_t run_start = 0, run_end = 0;
+    struct V850Range *runs = malloc(blocks * sizeof(struct V850Range));
+    for (size_t i = 0; i < blocks; i++) {
+        if (!dirty[i])
+            continue;
+        bool join = num_runs > 0 && (i - run_end - 1) * block_cost <= V850J_COST_COMMAND_US;
+        for (size_t j = run_end + 1; join && j < i; j++) {
+            join = checked[j];
+        }
+        if (join) {
+            erase_blocks += i - run_end;
+            run_end = i;
+        } else {
+            if (num_runs > 0) {
+                runs[num_runs - 1].start = run_start * block_size;
+                runs[num_runs - 1].end = (run_end + 1) * block_size - 1;
+            }
+            num_runs++;
+            erase_blocks++;
+            run_start = run_end = i;
+        }
+    }
+    if (num_runs > 0) {
+        runs[num_runs - 1].start = run_start * block_size;
+        runs[num_runs - 1].end = (run_end + 1) * block_size - 1;
+    }
+    free(checked);
+    free(dirty);
+
+    uint64_t blocks_cost = num_runs * (uint64_t)V850J_COST_COMMAND_US + erase_blocks * block_cost;
+    if (num_runs == 0) {
+        printf("Nothing to erase\n");
+    } else if (allow_chip_erase && V850J_COST_COMMAND_US + chip_cost < blocks_cost) {
+        printf("Erasing chip instead of %zu blocks\n", erase_blocks);
+        ret = v850j_chip_erase(dev);
+    } else {
+        printf("Erasing %zu blocks in %zu ranges\n", erase_blocks, num_runs);
+        for (size_t i = 0; i < num_runs && ret == 0; i++) {
+            ret = v850j_block_erase(dev, runs[i].start, runs[i].end);
+        }
+    }
+    free(runs);
+    return ret;
+}
+
+int v850j_checksum(struct V850Device *dev, uint32_t start, uint32_t end, uint16_t *sum)
+{
+    if ((start & 0xff) != 0x00 || (end & 0xff) != 0xff || end < start) {
+        fprintf(stderr, "%s: invalid range 0x%06" PRIX32 "-0x%06" PRIX32 "\n", __func__, start, end);
+        return -1;
+    }
+
+    int ret;
+    uint8_t buf[256];
+    size_t len;
+    v850j_address_encode(&buf[0], start);
+    v850j_address_encode(&buf[3], end);
+
+    wait_tCOM(dev);
+
+    ret = send_command_frame(dev, V850ESJx3L_CHECKSUM, buf, 6);
+    if (ret != 0)
+        return ret;
+    ret = receive_data_frame(dev, buf, &len);
+    if (ret != 0)
+        return ret;
+    if (buf[0] != V850ESJx3L_STATUS_ACK) {
+        fprintf(stderr, "%s: no ACK: %02" PRIX8 "\n", __func__, buf[0]);
+        return -1;
+    }
+    ret = receive_data_frame(dev, buf, &len);
+    if (ret != 0)
+        return ret;
+    if (len < 2) {
+        fprintf(stderr, "%s: short checksum frame (%zu)\n", __func__, len);
+        return -1;
+    }
+    *sum = (buf[0] << 8) | buf[1];
+    return 0;
+}
+
+/*
+ * Data frames are parsed straight into out and acknowledged as soon as
+ * they are complete, so the device is already sending the next frame
+ * while the host returns to the read loop.
+ */
+int v850j_read(struct V850Device *dev, uint32_t start, uint32_t end, uint8_t *out)
+{
+    if (end < start || end > 0xffffff) {
+        fprintf(stderr, "%s: invalid range 0x%06" PRIX32 "-0x%06" PRIX32 "\n", __func__, start, end);
+        return -1;
+    }
+
+    int ret;
+    uint8_t buf[256];
+    size_t len;
+    v850j_address_encode(&buf[0], start);
+    v850j_address_encode(&buf[3], end);
+
+    wait_tCOM(dev);
+
+    ret = send_command_frame(dev, V850ESJx3L_READ, buf, 6);
+    if (ret != 0)
+        return ret;
+    ret = receive_data_frame(dev, buf, &len);
+    if (ret != 0)
+        return ret;
+    if (buf[0] != V850ESJx3L_STATUS_ACK) {
+        fprintf(stderr, "%s: no ACK: %02" PRIX8 "\n", __func__, buf[0]);
+        return -1;
+    }
+
+    uint8_t ack = V850ESJx3L_STATUS_ACK;
+    uint8_t ack_frame[2 + 1 + 2];
+    size_t ack_length = v850j_data_frame_encode(ack_frame, &ack, 1, true);
+    size_t length = end - start + 1;
+    size_t offset = 0;
+    while (offset < length) {
+        const struct V850Frame *frame;
+        dev->parser.sink = out + offset;
+        dev->parser.sink_size = length - offset;
+        ret = receive_frame(dev, &frame, V850J_TIMEOUT_MS);
+        dev->parser.sink = NULL;
+        if (ret != 0)
+            return ret;
+        if (frame->data != out + offset) {
+            fprintf(stderr, "%s: oversized frame at 0x%06zX (%zu)\n", __func__,
+                    start + offset, frame->length);
+            return -1;
+        }
+        offset += frame->length;
+        if ((frame->end == V850ESJx3L_ETX) != (offset == length)) {
+            fprintf(stderr, "%s: unexpected frame end at 0x%06zX\n", __func__, start + offset);
+            return -1;
+        }
+
+        wait_tCOM(dev);
+        ret = send_data_frame(dev, ack_frame, ack_length);
+        if (ret != 0)
+            return ret;
+    }
+    return 0;
+}
+
+/*
+ * PROGRAMMING over a range, from data or, if df is given, from its frames
+ * starting at index first.
+ */
+static int program(struct V850Device *dev, uint32_t start, const uint8_t *data, size_t length,
+                   const struct V850DataFrames *df, size_t first)
+{
+    if (length == 0 || (start & 0x3) != 0 || (length & 0x3) != 0 ||
+        start + length - 1 > 0xffffff) {
+        fprintf(stderr, "%s: invalid range 0x%06" PRIX32 " (%zu bytes)\n", __func__, start, length);
+        return -1;
+    }
+
+    int ret;
+    uint8_t buf[256];
+    size_t len;
+    v850j_address_encode(&buf[0], start);
+    v850j_address_encode(&buf[3], start + length - 1);
+
+    wait_tCOM(dev);
+
+    ret = send_command_frame(dev, V850ESJx3L_PROGRAMMING, buf, 6);
+    if (ret != 0)
+        return ret;
+    ret = receive_data_frame(dev, buf, &len);
+    if (ret != 0)
+        return ret;
+    if (buf[0] != V850ESJx3L_STATUS_ACK) {
+        fprintf(stderr, "%s: no ACK: %02" PRIX8 "\n", __func__, buf[0]);
+        return -1;
+    }
+
+    /*
+     * The bootloader acknowledges each data frame (ST1: reception,
+     * ST2: write result) before it accepts the next one, so keep two
+     * frame descriptors: the header and checksum of the following frame
+     * are prepared while the status of the current one is still in
+     * flight, and its payload goes out straight from data. Pre-encoded
+     * frames are sent as they are, only the range's last one has its
+     * ETB replaced by a separate ETX.
+     */
+    static const uint8_t etx = V850ESJx3L_ETX;
+    struct V850FrameIov frames[2];
+    size_t frame_length[2];
+    int cur = 0;
+    size_t offset = 0;
+    size_t chunk = (length > V850J_DATA_FRAME_SIZE) ? V850J_DATA_FRAME_SIZE : length;
+    if (df == NULL)
+        frame_length[cur] = v850j_data_frame_iov(&frames[cur], data, chunk, chunk == length);
+    for (size_t i = 0; offset < length; i++) {
+        bool last = (offset + chunk == length);
+
+        if (df != NULL) {
+            const uint8_t *frame = df->frames[first + i];
+            size_t frame_len = df->lengths[first + i];
+            bool patch = last && frame[frame_len - 1] != V850ESJx3L_ETX;
+            frames[cur].iov[0] = (struct iovec){ (void *)frame, patch ? frame_len - 1 : frame_len };
+            frames[cur].iov[1] = (struct iovec){ (void *)&etx, patch ? 1 : 0 };
+            frames[cur].iov[2] = (struct iovec){ NULL, 0 };
+            frame_length[cur] = frame_len;
+        }
+        wait_tCOM(dev);
+        dev->stats_slot = STATS_DATA_FRAME;
+        ret = send_frame(dev, frames[cur].iov, 3, frame_length[cur]);
+        if (ret != 0)
+            return ret;
+
+        size_t next_chunk = 0;
+        if (!last) {
+            size_t next_offset = offset + chunk;
+            next_chunk = (length - next_offset > V850J_DATA_FRAME_SIZE)
+                         ? V850J_DATA_FRAME_SIZE : (length - next_offset);
+            if (df == NULL)
+                frame_length[!cur] = v850j_data_frame_iov(&frames[!cur], data + next_offset, next_chunk,
+                                                          next_offset + next_chunk == length);
+        }
+
+        ret = receive_data_frame(dev, buf, &len);
+        if (ret != 0)
+            return ret;
+        if (len < 2 || buf[0] != V850ESJx3L_STATUS_ACK) {
+            fprintf(stderr, "%s: data frame at 0x%06zX not received: %02" PRIX8 "\n",
+                    __func__, start + offset, buf[0]);
+            return -1;
+        }
+        if (buf[1] != V850ESJx3L_STATUS_ACK) {
+            fprintf(stderr, "%s: writing 0x%06zX failed: %02" PRIX8 "\n",
+                    __func__, start + offset, buf[1]);
+            return -1;
+        }
+
+        offset += chunk;
+        chunk = next_chunk;
+        cur = !cur;
+    }
+
+    /*
+     * Internal verify after the last data frame. The bootloader sends its
+     * result unprompted, so rather than polling STATUS into that answer
+     * give it as long as the range needs.
+     */
+    int timeout_ms = v850j_range_timeout_ms(dev, start, start + length - 1);
+    ret = receive_data_frame_timeout(dev, buf, &len, timeout_ms);
+    if (ret != 0)
+        return ret;
+    if (buf[0] != V850ESJx3L_STATUS_ACK) {
+        fprintf(stderr, "%s: internal verify failed: %02" PRIX8 "\n", __func__, buf[0]);
+        return -1;
+    }
+    if (dev->progress != NULL)
+        dev->progress(dev->progress_opaque, start, length);
+    return 0;
+}
+
+int v850j_program(struct V850Device *dev, uint32_t start, const uint8_t *data, size_t length)
+{
+    return program(dev, start, data, length, NULL, 0);
+}
+
+int v850j_program_frames(struct V850Device *dev, uint32_t start, size_t length,
+                         const struct V850DataFrames *df, size_t first)
+{
+    size_t count = (length + V850J_DATA_FRAME_SIZE - 1) / V850J_DATA_FRAME_SIZE;
+    if (first + count > df->count) {
+        fprintf(stderr, "%s: %zu frames from %zu, only %zu encoded\n", __func__, count, first,
+                df->count);
+        return -1;
+    }
+    return program(dev, start, NULL, length, df, first);
+}
+
+void v850j_data_frames_encode(struct V850DataFrames *df, size_t index,
+                              const uint8_t *data, size_t length)
+{
+    size_t offset = index * V850J_DATA_FRAME_SIZE;
+    size_t chunk = (length - offset > V850J_DATA_FRAME_SIZE)
+                   ? V850J_DATA_FRAME_SIZE : (length - offset);
+    df->lengths[index] = v850j_data_frame_encode(df->frames[index], data + offset, chunk,
+                                                 offset + chunk == length);
+}
+
+/*
+ * Run PROGRAMMING over one block with its encoded frames. If next_block is
+ * given, its frames are encoded into next one per frame while the device
+ * is still busy with ours.
+ */
+static int send_block(struct V850Device *dev, uint32_t start, size_t block_size,
+                      const struct V850DataFrames *bf, struct V850DataFrames *next,
+                      const uint8_t *next_block)
+{
+    int ret;
+    uint8_t buf[256];
+    size_t len;
+    v850j_address_encode(&buf[0], start);
+    v850j_address_encode(&buf[3], start + block_size - 1);
+
+    wait_tCOM(dev);
+
+    ret = send_command_frame(dev, V850ESJx3L_PROGRAMMING, buf, 6);
+    if (ret != 0)
+        return ret;
+    ret = receive_data_frame(dev, buf, &len);
+    if (ret != 0)
+        return ret;
+    if (buf[0] != V850ESJx3L_STATUS_ACK) {
+        fprintf(stderr, "%s: no ACK for writing: %02" PRIX8 "\n", __func__, buf[0]);
+        return -1;
+    }
+
+    for (size_t i = 0; i < bf->count; i++) {
+        uint32_t address = start + i * V850J_DATA_FRAME_SIZE;
+        wait_tCOM(dev);
+        ret = send_data_frame(dev, bf->frames[i], bf->lengths[i]);
+        if (ret != 0)
+            return ret;
+
+        if (next_block != NULL)
+            v850j_data_frames_encode(next, i, next_block, block_size);
+
+        ret = receive_data_frame(dev, buf, &len);
+        if (ret != 0)
+            return ret;
+        if (len < 2 || buf[0] != V850ESJx3L_STATUS_ACK) {
+            fprintf(stderr, "%s: data frame at 0x%06" PRIX32 " not received: %02" PRIX8 "\n",
+                    __func__, address, buf[0]);
+            return -1;
+        }
+        if (buf[1] != V850ESJx3L_STATUS_ACK) {
+            fprintf(stderr, "%s: writing 0x%06" PRIX32 " failed: %02" PRIX8 "\n",
+                    __func__, address, buf[1]);
+            return -1;
+        }
+    }
+
+    /* Internal verify after the last data frame, sent unprompted as in program() */
+    int timeout_ms = v850j_range_timeout_ms(dev, start, start + block_size - 1);
+    ret = receive_data_frame_timeout(dev, buf, &len, timeout_ms);
+    if (ret != 0)
+        return ret;
+    if (buf[0] != V850ESJx3L_STATUS_ACK) {
+        fprintf(stderr, "%s: internal verify failed: %02" PRIX8 "\n", __func__, buf[0]);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Program block by block, each followed by a CHECKSUM of the same block
+ * compared against its expected sum. Sending the block's data again for a
+ * VERIFY would double the time on the link; the 6-byte CHECKSUM command
+ * still catches a block that did not end up as intended.
+ */
+int v850j_program_verify(struct V850Device *dev, uint32_t start, const uint8_t *data, size_t length,
+                         size_t block_size, const uint16_t *block_sums)
+{
+    if (length == 0 || block_size == 0 || (block_size % V850J_DATA_FRAME_SIZE) != 0 ||
+        (start % block_size) != 0 || start + length - 1 > 0xffffff) {
+        fprintf(stderr, "%s: invalid range 0x%06" PRIX32 " (%zu bytes)\n", __func__, start, length);
+        return -1;
+    }
+
+    /* Blocks are programmed as a whole, so fill up the last one */
+    size_t blocks = (length + block_size - 1) / block_size;
+    size_t padded_length = blocks * block_size;
+    uint8_t *padded = NULL;
+    if (padded_length != length) {
+        padded = malloc(padded_length);
+        memcpy(padded, data, length);
+        memset(padded + length, 0xff, padded_length - length);
+        data = padded;
+    }
+
+    uint16_t *sums = NULL;
+    if (block_sums == NULL) {
+        sums = malloc(blocks * sizeof(uint16_t));
+        for (size_t i = 0; i < blocks; i++) {
+            sums[i] = block_checksum(data + i * block_size, block_size);
+        }
+        block_sums = sums;
+    }
+
+    size_t count = block_size / V850J_DATA_FRAME_SIZE;
+    struct V850DataFrames bf[2];
+    for (int i = 0; i < 2; i++) {
+        bf[i].frames = malloc(count * V850J_FRAME_BUFFER_SIZE);
+        bf[i].lengths = malloc(count * sizeof(size_t));
+        bf[i].count = count;
+    }
+    for (size_t i = 0; i < count; i++) {
+        v850j_data_frames_encode(&bf[0], i, data, block_size);
+    }
+
+    int ret = 0;
+    for (size_t b = 0; b < blocks && ret == 0; b++) {
+        uint32_t block_start = start + b * block_size;
+        uint32_t block_end = block_start + block_size - 1;
+        const uint8_t *next_block = (b + 1 < blocks) ? data + (b + 1) * block_size : NULL;
+        ret = send_block(dev, block_start, block_size, &bf[b & 1], &bf[!(b & 1)], next_block);
+        if (ret != 0)
+            break;
+        uint16_t sum;
+        ret = v850j_checksum(dev, block_start, block_end, &sum);
+        if (ret != 0)
+            break;
+        if (sum != block_sums[b]) {
+            fprintf(stderr, "%s: 0x%06" PRIX32 "-0x%06" PRIX32 " checksum %04" PRIX16
+                    " instead of %04" PRIX16 "\n", __func__, block_start, block_end, sum, block_sums[b]);
+            ret = -1;
+            break;
+        }
+        if (dev->progress != NULL)
+            dev->progress(dev->progress_opaque, block_start, block_size);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        free(bf[i].frames);
+        free(bf[i].lengths);
+    }
+    free(sums);
+    free(padded);
+    return ret;
+}
+
+int v850j_program_delta(struct V850Device *dev, uint32_t start, const uint8_t *data, size_t length,
+                        size_t block_size, const uint16_t *block_sums)
+{
+    if (length == 0 || block_size == 0 || (block_size & 0xff) != 0 || (start % block_size) != 0) {
+        fprintf(stderr, "%s: invalid range 0x%06" PRIX32 " (%zu bytes)\n", __func__, start, length);
+        return -1;
+    }
+
+    /* Blocks are erased as a whole, so fill up the last one */
+    size_t blocks = (length + block_size - 1) / block_size;
+    size_t padded_length = blocks * block_size;
+    uint8_t *padded = NULL;
+    if (padded_length != length) {
+        padded = malloc(padded_length);
+        memcpy(padded, data, length);
+        memset(padded + length, 0xff, padded_length - length);
+        data = padded;
+    }
+
+    /* Expected checksums up front, so the device loop only compares */
+    uint16_t *sums = NULL;
+    if (block_sums == NULL) {
+        sums = malloc(blocks * sizeof(uint16_t));
+        for (size_t i = 0; i < blocks; i++) {
+            sums[i] = block_checksum(data + i * block_size, block_size);
+        }
+        block_sums = sums;
+    }
+
+    int ret = 0;
+    size_t changed = 0;
+    size_t first_dirty = blocks;
+    for (size_t i = 0; i <= blocks; i++) {
+        bool dirty = false;
+        if (i < blocks) {
+            uint32_t block_start = start + i * block_size;
+            uint16_t device_sum;
+            ret = v850j_checksum(dev, block_start, block_start + block_size - 1, &device_sum);
+            if (ret != 0)
+                break;
+            dirty = block_sums[i] != device_sum;
+        }
+        if (dirty) {
+            changed++;
+            if (first_dirty == blocks)
+                first_dirty = i;
+            continue;
+        }
+        if (first_dirty == blocks)
+            continue;
+
+        /* Erase and reprogram the run of differing blocks in one go */
+        uint32_t run_start = start + first_dirty * block_size;
+        size_t run_length = (i - first_dirty) * block_size;
+        printf("Updating 0x%06" PRIX32 "-0x%06zX\n", run_start, run_start + run_length - 1);
+        ret = v850j_block_erase(dev, run_start, run_start + run_length - 1);
+        if (ret != 0)
+            break;
+        ret = v850j_program(dev, run_start, data + first_dirty * block_size, run_length);
+        if (ret != 0)
+            break;
+        first_dirty = blocks;
+    }
+    if (ret == 0)
+        printf("%zu of %zu blocks updated\n", changed, blocks);
+
+    free(sums);
+    free(padded);
+    return ret;
+}
+
+int v850j_reenter(struct V850Device *dev, uint32_t frequency)
+{
+    int ret;
+
+    /* Pulse the target's RESET line (RTS) to re-enter the bootloader */
+    ret = v850j_78k0_set_dtr_rts(&dev->uart, false, false);
+    ret = v850j_78k0_set_dtr_rts(&dev->uart, false, true);
+
+    ret = v850j_reset(dev);
+    if (ret != 0)
+        return ret;
+    return v850j_osc_frequency_set(dev, frequency);
+}
+
+int v850j_connect(struct V850Device *dev, uint32_t frequency, uint32_t baud_rate)
+{
+    int ret = v850j_reenter(dev, frequency);
+    if (ret != 0)
+        return ret;
+    return v850j_baud_rate_set(dev, baud_rate);
+}
+
+static bool autotune_check(struct V850Device *dev, uint32_t frequency, uint32_t baud_rate)
+{
+    for (int i = 0; i < V850J_AUTOTUNE_TRIALS; i++) {
+        if (v850j_connect(dev, frequency, baud_rate) != 0 ||
+            v850j_get_silicon_signature(dev) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int v850j_autotune(struct V850Device *dev, uint32_t frequency, uint32_t baud_rate)
+{
+    struct V850Timings defaults;
+    dev->fx = frequency;
+    v850j_default_timings(dev, &defaults);
+    dev->timings = defaults;
+    dev->timings_tuned = true;
+
+    if (!autotune_check(dev, frequency, baud_rate)) {
+        fprintf(stderr, "%s: not working with data sheet timings\n", __func__);
+        dev->timings_tuned = false;
+        return -1;
+    }
+
+    uint32_t *values[] = {
+        &dev->timings.t12, &dev->timings.t2C, &dev->timings.tCOM, &dev->timings.tWT10,
+    };
+    const uint32_t limits[] = { defaults.t12, defaults.t2C, defaults.tCOM, defaults.tWT10 };
+    const char *names[] = { "t12", "t2C", "tCOM", "tWT10" };
+    for (int i = 0; i < 4; i++) {
+        /* Bisect between a failing (or zero) and a known good value */
+        uint32_t good = *values[i];
+        uint32_t bad = 0;
+        *values[i] = 0;
+        if (autotune_check(dev, frequency, baud_rate)) {
+            good = 0;
+        }
+        while (good - bad > 1) {
+            uint32_t mid = bad + (good - bad) / 2;
+            *values[i] = mid;
+            if (autotune_check(dev, frequency, baud_rate)) {
+                good = mid;
+            } else {
+                bad = mid;
+            }
+        }
+        uint32_t value = good + good * V850J_AUTOTUNE_MARGIN_PERCENT / 100 + 1;
+        *values[i] = (value < limits[i]) ? value : limits[i];
+        printf("%s: %" PRIu32 " us (data sheet %" PRIu32 " us)\n", names[i], *values[i], limits[i]);
+    }
+
+    if (!autotune_check(dev, frequency, baud_rate)) {
+        fprintf(stderr, "%s: tuned timings not reliable, using data sheet timings\n", __func__);
+        dev->timings = defaults;
+        return -1;
+    }
+    return 0;
+}
+
+int v850j_timings_load(struct V850Device *dev, const char *filename)
+{
+    FILE *f = fopen(filename, "r");
+    if (f == NULL)
+        return -1;
+    struct V850Timings t;
+    v850j_default_timings(dev, &t);
+    char line[64];
+    unsigned int value;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "t12=%u", &value) == 1) {
+            t.t12 = value;
+        } else if (sscanf(line, "t2C=%u", &value) == 1) {
+            t.t2C = value;
+        } else if (sscanf(line, "tCOM=%u", &value) == 1) {
+            t.tCOM = value;
+        } else if (sscanf(line, "tWT10=%u", &value) == 1) {
+            t.tWT10 = value;
+        }
+    }
+    fclose(f);
+    dev->timings = t;
+    dev->timings_tuned = true;
+    return 0;
+}
+
+int v850j_timings_save(struct V850Device *dev, const char *filename)
+{
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) {
+        perror(filename);
+        return -1;
+    }
+    const struct V850Timings *t = v850j_timings(dev);
+    fprintf(f, "t12=%" PRIu32 "\nt2C=%" PRIu32 "\ntCOM=%" PRIu32 "\ntWT10=%" PRIu32 "\n",
+            t->t12, t->t2C, t->tCOM, t->tWT10);
+    return fclose(f);
+}
+
+/*
+ * Pick up a bootloader left running by an earlier session: restore the
+ * line at its baud rate and check that a STATUS command gets answered.
+ */
+int v850j_resume(struct V850Device *dev)
+{
+    dev->rx_pos = dev->rx_length = 0;
+    v850j_frame_parser_reset(&dev->parser);
+
+    uint8_t line_settings = USB_78K0_LINE_CONTROL_FLOW_CONTROL_NONE |
+                            USB_78K0_LINE_CONTROL_PARITY_NONE |
+                            USB_78K0_LINE_CONTROL_STOP_BITS_1 |
+                            USB_78K0_LINE_CONTROL_DATA_SIZE_8;
+    usb_78k0_batch_begin(&dev->uart);
+    v850j_78k0_open_close(&dev->uart, true);
+    v850j_78k0_line_control(&dev->uart, dev->baud_rate, line_settings);
+    v850j_78k0_set_dtr_rts(&dev->uart, false, true);
+    int ret = usb_78k0_batch_end(&dev->uart);
+    if (ret != LIBUSB_SUCCESS)
+        return -1;
+
+    wait_tCOM(dev);
+    ret = send_command_frame(dev, V850ESJx3L_STATUS, NULL, 0);
+    if (ret != 0)
+        return ret;
+    const struct V850Frame *frame;
+    ret = receive_frame(dev, &frame, V850J_NEGOTIATE_TIMEOUT_MS);
+    if (ret != 0) {
+        /* Whatever is on the line belongs to no session of ours */
+        dev->rx_pos = dev->rx_length = 0;
+        v850j_frame_parser_reset(&dev->parser);
+    }
+    return ret;
+}
+
+int v850j_session_load(struct V850Device *dev, const char *filename)
+{
+    FILE *f = fopen(filename, "r");
+    if (f == NULL)
+        return -1;
+    uint32_t fx = 0, baud_rate = 0;
+    char line[64];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "fx=%" SCNu32, &fx) == 1)
+            continue;
+        sscanf(line, "baud=%" SCNu32, &baud_rate);
+    }
+    fclose(f);
+    if (fx == 0 || baud_rate == 0)
+        return -1;
+    dev->fx = fx;
+    dev->baud_rate = baud_rate;
+    return 0;
+}
+
+int v850j_session_save(struct V850Device *dev, const char *filename)
+{
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) {
+        perror(filename);
+        return -1;
+    }
+    fprintf(f, "fx=%" PRIu32 "\nbaud=%" PRIu32 "\n", dev->fx, dev->baud_rate);
+    return fclose(f);
+}
+
+const char *v850j_stats_name(int slot)
+{
+    if (slot == STATS_DATA_FRAME)
+        return "DATA_FRAME";
+    const char *name = v850j_command_name(slot);
+    return (name != NULL) ? name : "UNKNOWN";
+}